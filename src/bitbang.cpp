@@ -0,0 +1,366 @@
+#include "bitbang.hpp"
+#include "constants.hpp"
+#include "sysfs.hpp"
+#include "registry.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+static const int _BITBANG_CHANNEL = -2;  // registry channel of lines owned by a bus
+
+enum : uint8_t {
+    _OP_WRITE = 0,
+    _OP_SAMPLE = 1,
+    _OP_DELAY = 2
+};
+
+static int64_t _monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+static int _open_line(int pin, const char* attr) {
+    std::string path = std::string(sysfs_root()) + "/sys/class/gpio/gpio" + std::to_string(pin) + "/" + attr;
+    await_permissions(path);
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    return fd;
+}
+
+void _bitbang_line::claim(int line, int dir, bool open_direction) {
+    {
+        std::lock_guard<std::mutex> lock(_exports.lock(line));
+        if (_exports.configured(line)) {
+            throw std::runtime_error("GPIO line " + std::to_string(line) + " is already in use");
+        }
+        export_pin(line);
+        try {
+            direction(line, dir);
+        } catch (...) {
+            unexport_pin(line);
+            throw;
+        }
+        _exports.claim(line, _BITBANG_CHANNEL, dir);  // level stays unknown, the bus writes through its own fds
+    }
+    pin = line;
+    value_fd = _open_line(line, "value");
+    if (open_direction) {
+        direction_fd = _open_line(line, "direction");
+    }
+}
+
+_bitbang_line::~_bitbang_line() {
+    if (value_fd >= 0) close(value_fd);
+    if (direction_fd >= 0) close(direction_fd);
+    if (pin < 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(_exports.lock(pin));
+    if (_exports.channel(pin) != _BITBANG_CHANNEL) {
+        return;  // cleanup() already took it back, and it may have been set up again since
+    }
+    try {
+        unexport_pin(pin);
+    } catch (const std::exception& e) {
+        std::cerr << "Could not unexport GPIO line " << pin << ": " << e.what() << std::endl;
+    }
+    _exports.release(pin);
+}
+
+void _bitbang_program::clear() {
+    // Keeps the capacity, so repeated transfers of the same size do not allocate
+    ops.clear();
+    samples.clear();
+    edges = 0;
+}
+
+void _bitbang_program::write(int fd, const char* text) {
+    ops.push_back({fd, _OP_WRITE, static_cast<uint8_t>(std::strlen(text)), text, 0});
+}
+
+uint32_t _bitbang_program::sample(int fd) {
+    uint32_t slot = samples.size();
+    samples.push_back(0);
+    ops.push_back({fd, _OP_SAMPLE, 0, nullptr, slot});
+    return slot;
+}
+
+void _bitbang_program::delay() {
+    ops.push_back({-1, _OP_DELAY, 0, nullptr, 0});
+}
+
+void _bitbang_program::edge() {
+    edges++;
+}
+
+void _bitbang_program::run(int64_t half_period_ns) {
+    int64_t start = _monotonic_ns();
+    int64_t next = start;
+    char value[2];
+
+    for (const _bitbang_op& op : ops) {
+        switch (op.kind) {
+            case _OP_WRITE:
+                if (pwrite(op.fd, op.text, op.length, 0) != op.length) {
+                    throw std::system_error(errno, std::generic_category(), "bit-bang write");
+                }
+                break;
+            case _OP_SAMPLE:
+                if (pread(op.fd, value, 1, 0) != 1) {
+                    throw std::system_error(errno, std::generic_category(), "bit-bang read");
+                }
+                samples[op.slot] = (value[0] == '1');
+                break;
+            case _OP_DELAY:
+                if (half_period_ns > 0) {  // busy wait, sleeping is far coarser than a bit time
+                    next += half_period_ns;
+                    while (_monotonic_ns() < next) {
+                    }
+                }
+                break;
+        }
+    }
+
+    elapsed_ns = _monotonic_ns() - start;
+}
+
+static double _achieved_clock(const _bitbang_program& program) {
+    if (program.elapsed_ns <= 0) {
+        return 0;
+    }
+    return program.edges * 1e9 / program.elapsed_ns;
+}
+
+SoftSPI::SoftSPI(int sclk, int mosi, int miso, int cs, int mode, int frequency)
+    : sclk(sclk), mosi(mosi), miso(miso), cs(cs), mode(mode),
+      half_period_ns(frequency > 0 ? 500000000LL / frequency : 0) {
+    if (mode < 0 || mode > 3) {
+        throw std::invalid_argument("SPI mode must be 0-3");
+    }
+
+    // Lines claimed so far are released by their destructors if a later one fails
+    int out = GPIO.getattr<int>("OUT");
+    sclk_line.claim(sclk, out);
+    mosi_line.claim(mosi, out);
+    if (cs >= 0) cs_line.claim(cs, out);
+    if (miso >= 0) miso_line.claim(miso, GPIO.getattr<int>("IN"));
+
+    sysfs_write_int(sclk_line.value_fd, mode >> 1);  // idle clock level
+    if (cs >= 0) sysfs_write_int(cs_line.value_fd, 1);
+}
+
+SoftSPI::~SoftSPI() {
+    // The lines close their fds and give back their exports
+}
+
+void SoftSPI::transfer(const uint8_t* tx, uint8_t* rx, std::size_t length) {
+    // MSB first. CPHA 0 samples on the leading clock edge, CPHA 1 on the trailing one
+    const char* idle = (mode >> 1) ? "1" : "0";
+    const char* active = (mode >> 1) ? "0" : "1";
+    bool cpha = mode & 1;
+    int mosi_level = -1;  // skip MOSI writes that would not change the line
+
+    program.clear();
+    if (cs_line.value_fd >= 0) {
+        program.write(cs_line.value_fd, "0");
+    }
+    for (std::size_t i = 0; i < length; i++) {
+        uint8_t byte = tx ? tx[i] : 0;
+        for (int bit = 7; bit >= 0; bit--) {
+            int level = (byte >> bit) & 1;
+            if (!cpha && level != mosi_level) {
+                program.write(mosi_line.value_fd, level ? "1" : "0");
+                mosi_level = level;
+            }
+            program.delay();
+            program.write(sclk_line.value_fd, active);
+            program.edge();
+            if (cpha && level != mosi_level) {
+                program.write(mosi_line.value_fd, level ? "1" : "0");
+                mosi_level = level;
+            }
+            if (!cpha && miso_line.value_fd >= 0 && rx) {
+                program.sample(miso_line.value_fd);
+            }
+            program.delay();
+            program.write(sclk_line.value_fd, idle);
+            if (cpha && miso_line.value_fd >= 0 && rx) {
+                program.sample(miso_line.value_fd);
+            }
+        }
+    }
+    if (cs_line.value_fd >= 0) {
+        program.write(cs_line.value_fd, "1");
+    }
+
+    program.run(half_period_ns);
+
+    if (rx && miso_line.value_fd >= 0) {
+        for (std::size_t i = 0; i < length; i++) {
+            uint8_t byte = 0;
+            for (int bit = 0; bit < 8; bit++) {
+                byte = (byte << 1) | program.samples[i * 8 + bit];
+            }
+            rx[i] = byte;
+        }
+    }
+}
+
+void SoftSPI::write(const uint8_t* data, std::size_t length) {
+    transfer(data, nullptr, length);
+}
+
+double SoftSPI::clock() const {
+    // SCLK frequency achieved by the last transfer, in Hz
+    return _achieved_clock(program);
+}
+
+SoftI2C::SoftI2C(int scl, int sda, int frequency)
+    : scl(scl), sda(sda), half_period_ns(frequency > 0 ? 500000000LL / frequency : 0) {
+    int in = GPIO.getattr<int>("IN");  // released, bus idles high
+    scl_line.claim(scl, in, true);
+    sda_line.claim(sda, in, true);
+}
+
+SoftI2C::~SoftI2C() {
+    // The lines close their fds and give back their exports
+}
+
+void SoftI2C::release(int fd) {
+    program.write(fd, "in");
+}
+
+void SoftI2C::pull(int fd) {
+    program.write(fd, "low");  // output, driven low, in one write
+}
+
+void SoftI2C::start() {
+    release(sda_line.direction_fd);
+    release(scl_line.direction_fd);
+    program.delay();
+    pull(sda_line.direction_fd);
+    program.delay();
+    pull(scl_line.direction_fd);
+}
+
+void SoftI2C::stop() {
+    pull(sda_line.direction_fd);
+    program.delay();
+    release(scl_line.direction_fd);
+    program.delay();
+    release(sda_line.direction_fd);
+    program.delay();
+}
+
+void SoftI2C::put_byte(uint8_t byte, std::vector<uint32_t>& acks) {
+    for (int bit = 7; bit >= 0; bit--) {
+        if ((byte >> bit) & 1) {
+            release(sda_line.direction_fd);
+        } else {
+            pull(sda_line.direction_fd);
+        }
+        program.delay();
+        release(scl_line.direction_fd);
+        program.edge();
+        program.delay();
+        pull(scl_line.direction_fd);
+    }
+    release(sda_line.direction_fd);  // the device acknowledges by pulling SDA low
+    program.delay();
+    release(scl_line.direction_fd);
+    program.edge();
+    acks.push_back(program.sample(sda_line.value_fd));
+    program.delay();
+    pull(scl_line.direction_fd);
+}
+
+void SoftI2C::get_byte(std::vector<uint32_t>& bits, bool ack) {
+    release(sda_line.direction_fd);
+    for (int bit = 0; bit < 8; bit++) {
+        program.delay();
+        release(scl_line.direction_fd);
+        program.edge();
+        bits.push_back(program.sample(sda_line.value_fd));
+        program.delay();
+        pull(scl_line.direction_fd);
+    }
+    if (ack) {
+        pull(sda_line.direction_fd);
+    } else {
+        release(sda_line.direction_fd);
+    }
+    program.delay();
+    release(scl_line.direction_fd);
+    program.edge();
+    program.delay();
+    pull(scl_line.direction_fd);
+}
+
+void SoftI2C::write_read(uint8_t address, const uint8_t* tx, std::size_t tx_length, uint8_t* rx, std::size_t rx_length) {
+    // The whole transaction runs as one program. Clock stretching is not
+    // supported, and ACKs are checked after the program has finished.
+    if (address > 0x7F) {
+        throw std::invalid_argument("I2C address must be 7-bit");
+    }
+
+    program.clear();
+    acks.clear();
+    bits.clear();
+
+    if (tx_length > 0) {
+        start();
+        put_byte(address << 1, acks);
+        for (std::size_t i = 0; i < tx_length; i++) {
+            put_byte(tx[i], acks);
+        }
+    }
+    if (rx_length > 0) {
+        start();  // repeated start when following a write
+        put_byte((address << 1) | 1, acks);
+        for (std::size_t i = 0; i < rx_length; i++) {
+            get_byte(bits, i + 1 < rx_length);  // NACK the last byte
+        }
+    }
+    stop();
+
+    program.run(half_period_ns);
+
+    for (std::size_t i = 0; i < acks.size(); i++) {
+        if (program.samples[acks[i]]) {
+            char hex[8];
+            std::snprintf(hex, sizeof(hex), "0x%02x", address);
+            throw std::runtime_error(std::string("I2C device ") + hex + " did not acknowledge byte " + std::to_string(i));
+        }
+    }
+    for (std::size_t i = 0; i < rx_length; i++) {
+        uint8_t byte = 0;
+        for (int bit = 0; bit < 8; bit++) {
+            byte = (byte << 1) | program.samples[bits[i * 8 + bit]];
+        }
+        rx[i] = byte;
+    }
+}
+
+void SoftI2C::write(uint8_t address, const uint8_t* data, std::size_t length) {
+    write_read(address, data, length, nullptr, 0);
+}
+
+void SoftI2C::read(uint8_t address, uint8_t* data, std::size_t length) {
+    write_read(address, nullptr, 0, data, length);
+}
+
+double SoftI2C::clock() const {
+    // SCL frequency achieved by the last transaction, in Hz
+    return _achieved_clock(program);
+}
@@ -0,0 +1,104 @@
+#ifndef BITBANG_HPP
+#define BITBANG_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Software SPI / I2C masters for pins that are not muxed to the hardware
+// controllers (SPI0/SPI1/TWI1/TWI2 in boards.cpp are the usual candidates).
+// A transfer is first compiled into a flat list of pin operations on value
+// and direction files that were opened once, then executed in one tight loop.
+
+struct _bitbang_op {
+    int fd;
+    uint8_t kind;
+    uint8_t length;
+    const char* text;  // "0", "1", "in", "low"
+    uint32_t slot;     // sample index for reads
+};
+
+class _bitbang_program {
+public:
+    void clear();
+    void write(int fd, const char* text);
+    uint32_t sample(int fd);
+    void delay();
+    void edge();
+    void run(int64_t half_period_ns);
+
+    std::vector<_bitbang_op> ops;
+    std::vector<uint8_t> samples;
+    unsigned long edges = 0;  // SCLK/SCL cycles in the program
+    int64_t elapsed_ns = 0;   // duration of the last run
+};
+
+// One line of a bit-banged bus. It is claimed in the export registry, so
+// setup() refuses it and nobody else's line is unexported on release, and it
+// owns its attribute fds; a constructor that throws halfway releases the
+// lines it already holds.
+class _bitbang_line {
+public:
+    _bitbang_line() = default;
+    ~_bitbang_line();
+    _bitbang_line(const _bitbang_line&) = delete;
+    _bitbang_line& operator=(const _bitbang_line&) = delete;
+
+    void claim(int pin, int direction, bool open_direction = false);
+
+    int pin = -1;  // -1 while unused
+    int value_fd = -1;
+    int direction_fd = -1;
+};
+
+class SoftSPI {
+public:
+    // Lines are SoC line numbers; miso and cs may be -1 when unused
+    SoftSPI(int sclk, int mosi, int miso, int cs, int mode = 0, int frequency = 0);
+    ~SoftSPI();
+    SoftSPI(const SoftSPI&) = delete;
+    SoftSPI& operator=(const SoftSPI&) = delete;
+
+    void transfer(const uint8_t* tx, uint8_t* rx, std::size_t length);
+    void write(const uint8_t* data, std::size_t length);
+    double clock() const;
+
+private:
+    int sclk, mosi, miso, cs;
+    int mode;
+    int64_t half_period_ns;
+    _bitbang_line sclk_line, mosi_line, miso_line, cs_line;
+    _bitbang_program program;
+};
+
+class SoftI2C {
+public:
+    // Open-drain emulation: a line is released by switching it to input (the
+    // external pull-up takes it high) and pulled low by driving it as output
+    SoftI2C(int scl, int sda, int frequency = 100000);
+    ~SoftI2C();
+    SoftI2C(const SoftI2C&) = delete;
+    SoftI2C& operator=(const SoftI2C&) = delete;
+
+    void write(uint8_t address, const uint8_t* data, std::size_t length);
+    void read(uint8_t address, uint8_t* data, std::size_t length);
+    void write_read(uint8_t address, const uint8_t* tx, std::size_t tx_length, uint8_t* rx, std::size_t rx_length);
+    double clock() const;
+
+private:
+    void start();
+    void stop();
+    void release(int fd);
+    void pull(int fd);
+    void put_byte(uint8_t byte, std::vector<uint32_t>& acks);
+    void get_byte(std::vector<uint32_t>& bits, bool ack);
+
+    int scl, sda;
+    int64_t half_period_ns;
+    _bitbang_line scl_line, sda_line;
+    _bitbang_program program;
+    std::vector<uint32_t> acks;
+    std::vector<uint32_t> bits;
+};
+
+#endif // BITBANG_HPP
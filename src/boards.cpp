@@ -1,8 +1,16 @@
 #include "boards.hpp"
 #include "constants.hpp"
 #include <string>
+#include <cstring>
+#include <cstdlib>
 #include <cassert>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
 #include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
 
 class _sunXi {
 public:
@@ -25,119 +33,257 @@ public:
     }
 };
 
-std::unordered_map<std::string, int> _board_model = {
-    {"Repka-Pi3-H5", GPIO.getattr<int>("REPKAPI3")}
+_sunXi sunXi;
+_SOC soc;
+
+static const PWMChannel _repkapi3_pwm[] = {
+    {0, 0, 362}  // PL10/PWM0, physical pin 33
+};
+
+static const PeripheralPin _repkapi3_peripherals[] = {
+    {"TWI1_SDA", 12}, {"TWI1_SCK", 11},
+    {"TWI2_SDA", 19}, {"TWI2_SCK", 18},
+    {"UART0_TX", 4}, {"UART0_RX", 5},
+    {"UART2_TX", 0}, {"UART2_RX", 1},
+    {"S_UART_TX", 354}, {"S_UART_RX", 355},
+    {"SPI0_MOSI", 64}, {"SPI0_MISO", 65}, {"SPI0_CLK", 66}, {"SPI0_CS0", 67},
+    {"SPI1_MOSI", 15}, {"SPI1_MISO", 16}, {"SPI1_CLK", 14}, {"SPI1_CS0", 13},
+    {"PWM0", 362}
 };
 
-std::unordered_map<int, std::unordered_map<int, int>> _pin_map = {
-    {GPIO.getattr<int>("REPKAPI3"), {
-        {0, "Repka Pi 3"},
-        {1, {{"P1_REVISION", 3}, {"TYPE", "Repka Pi 3"}, {"MANUFACTURER", "ИНТЕЛЛЕКТ"}, {"RAM", "1024M"}, {"REVISION", ""}, {"PROCESSOR", "Allwinner H5"}}},
-        {GPIO.getattr<int>("BOARD"), {
-            {3, 12},    // PA12/TWI1_SDA/DI_RX/PA_EINT12
-            {5, 11},    // PA11/TWI1_SCK/DI_TX/PA_EINT11
-            {7, 7},     // PA7
-            {8, 4},     // PA4/UART0_TX
-            {10, 5},    // PA5/UART0_RX
-            {11, 8},    // PA8
-            {12, 6},    // PA14
-            {13, 9},    // PA9
-            {15, 10},   // PA10
-            {16, 354},  // PL2/S_UART_TX
-            {18, 355},  // PL3/S_UART_RX
-            {19, 64},   // PA15/SPI0_MOSI
-            {21, 65},   // PA16/SPI0_MISO
-            {22, 2},    // PA2
-            {23, 66},   // PA14/SPI0_CLK
-            {24, 67},   // PC3/SPI0_CS0
-            {26, 3},    // PA3/SPI0_CS0
-            {27, 19},   // PA19/TWI2_SDA
-            {28, 18},   // PA18/TWI2_SCK
-            {29, 0},    // PA0/UART2_TX
-            {31, 1},    // PA1/UART2_RX
-            {32, 363},  // PL11
-            {33, 362},  // PL10/PWM0
-            {35, 16},   // PA16/SPI1_MISO
-            {36, 13},   // PA13/SPI1_CS0
-            {37, 21},   // PA21
-            {38, 15},   // PG6/SPI1_MOSI
-            {40, 14}    // PG7/SPI1_CLK
-        }},
-        {GPIO.getattr<int>("BCM"), {
-            {2, 12},
-            {3, 11},
-            {4, 7},
-            {14, 4},
-            {15, 5},
-            {17, 8},
-            {18, 6},
-            {27, 9},
-            {22, 10},
-            {23, 354},
-            {24, 355},
-            {10, 64},
-            {9, 65},
-            {25, 2},
-            {11, 66},
-            {8, 67},
-            {7, 3},
-            {5, 0},
-            {6, 1},
-            {12, 363},
-            {13, 362},
-            {19, 16},
-            {16, 13},
-            {26, 21},
-            {20, 15},
-            {21, 14}
-        }},
-        {GPIO.getattr<int>("SUNXI"), _sunXi()},
-        {GPIO.getattr<int>("SOC"), _SOC()}
-    }}
+static const BoardDescriptor _repkapi3 = {
+    GPIO.getattr<int>("REPKAPI3"),
+    "Repka-Pi3-H5",
+    "repka,repka-pi3-h5",
+    "Repka Pi 3",
+    "ИНТЕЛЛЕКТ",
+    "Allwinner H5",
+    3,
+    {
+        -1,                 // (no pin 0)
+        -1,  -1,            // 3V3, 5V
+        12,  -1,            // PA12/TWI1_SDA/DI_RX/PA_EINT12, 5V
+        11,  -1,            // PA11/TWI1_SCK/DI_TX/PA_EINT11, GND
+        7,   4,             // PA7, PA4/UART0_TX
+        -1,  5,             // GND, PA5/UART0_RX
+        8,   6,             // PA8, PA14
+        9,   -1,            // PA9, GND
+        10,  354,           // PA10, PL2/S_UART_TX
+        -1,  355,           // 3V3, PL3/S_UART_RX
+        64,  -1,            // PA15/SPI0_MOSI, GND
+        65,  2,             // PA16/SPI0_MISO, PA2
+        66,  67,            // PA14/SPI0_CLK, PC3/SPI0_CS0
+        -1,  3,             // GND, PA3/SPI0_CS0
+        19,  18,            // PA19/TWI2_SDA, PA18/TWI2_SCK
+        0,   -1,            // PA0/UART2_TX, GND
+        1,   363,           // PA1/UART2_RX, PL11
+        362, -1,            // PL10/PWM0, GND
+        16,  13,            // PA16/SPI1_MISO, PA13/SPI1_CS0
+        21,  15,            // PA21, PG6/SPI1_MOSI
+        -1,  14             // GND, PG7/SPI1_CLK
+    },
+    {
+        -1,  -1,  12,  11,  7,   0,   1,   3,    // BCM 0-7
+        67,  65,  64,  66,  363, 362, 4,   5,    // BCM 8-15
+        13,  8,   6,   16,  15,  14,  10,  354,  // BCM 16-23
+        355, 2,   21,  9                         // BCM 24-27
+    },
+    _repkapi3_pwm, sizeof(_repkapi3_pwm) / sizeof(_repkapi3_pwm[0]),
+    _repkapi3_peripherals, sizeof(_repkapi3_peripherals) / sizeof(_repkapi3_peripherals[0])
 };
 
+static std::vector<const BoardDescriptor*> _board_registry = {&_repkapi3};
+
+// Result of autodetection, filled once on first use
+static std::mutex _detect_lock;
+static bool _detected = false;
+static const BoardDescriptor* _detected_board = nullptr;
+static long _detected_ram_kb = 0;
+static std::string _board_root = "";
+
+static std::size_t _read_file(const std::string& path, char* buffer, std::size_t size) {
+    // Small /proc files fit in one read(), no stream or shell involved.
+    // The buffer is always NUL-terminated, empty when the file cannot be read.
+    buffer[0] = '\0';
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t n = read(fd, buffer, size - 1);
+    close(fd);
+    if (n < 0) {
+        n = 0;
+    }
+    buffer[n] = '\0';
+    return static_cast<std::size_t>(n);
+}
+
+static long _parse_meminfo(const char* meminfo) {
+    const char* field = std::strstr(meminfo, "MemTotal:");
+    if (!field) {
+        return 0;
+    }
+    return std::strtol(field + std::strlen("MemTotal:"), nullptr, 10);  // kB
+}
+
+static const BoardDescriptor* _match_compatible(const char* compatible, std::size_t size) {
+    // compatible is a list of NUL separated strings, most specific first
+    for (std::size_t i = 0; i < size; i += std::strlen(compatible + i) + 1) {
+        for (const BoardDescriptor* board : _board_registry) {
+            if (std::strcmp(compatible + i, board->compatible) == 0) {
+                return board;
+            }
+        }
+    }
+    return nullptr;
+}
+
+static void _detect_board() {
+    // Caller must hold _detect_lock
+    if (_detected) {
+        return;
+    }
+
+    char buffer[4096];
+    std::size_t n = _read_file(_board_root + "/proc/device-tree/compatible", buffer, sizeof(buffer));
+    _detected_board = _match_compatible(buffer, n);
+
+    if (!_detected_board) {  // older device trees, fall back to the model string
+        n = _read_file(_board_root + "/proc/device-tree/model", buffer, sizeof(buffer));
+        if (n > 0) {
+            _detected_board = find_board(std::string(buffer));
+        }
+    }
+
+    n = _read_file(_board_root + "/proc/meminfo", buffer, sizeof(buffer));
+    _detected_ram_kb = (n > 0) ? _parse_meminfo(buffer) : 0;
+    _detected = true;
+}
+
+void register_board(const BoardDescriptor* board) {
+    // Register boards before any pins are set up, lookups do not lock
+    std::lock_guard<std::mutex> lock(_detect_lock);
+    if (std::find(_board_registry.begin(), _board_registry.end(), board) == _board_registry.end()) {
+        _board_registry.push_back(board);
+    }
+    _detected = false;
+}
+
+const BoardDescriptor* find_board(int board) {
+    for (const BoardDescriptor* descriptor : _board_registry) {
+        if (descriptor->id == board) {
+            return descriptor;
+        }
+    }
+    return nullptr;
+}
+
+const BoardDescriptor* find_board(const std::string& model) {
+    for (const BoardDescriptor* descriptor : _board_registry) {
+        if (model == descriptor->model) {
+            return descriptor;
+        }
+    }
+    return nullptr;
+}
+
+void set_board_override(const BoardDescriptor* board, long ram_kb) {
+    // Skip autodetection entirely, used by tests and by boards with broken device trees
+    std::lock_guard<std::mutex> lock(_detect_lock);
+    _detected_board = board;
+    _detected_ram_kb = ram_kb;
+    _detected = true;
+}
+
+void set_board_root(const std::string& root) {
+    // Read /proc from another directory, e.g. a captured copy of a board's /proc
+    std::lock_guard<std::mutex> lock(_detect_lock);
+    _board_root = root;
+    _detected = false;
+}
+
+void reset_board_detection() {
+    std::lock_guard<std::mutex> lock(_detect_lock);
+    _detected = false;
+}
+
+static const BoardDescriptor* _get_descriptor(int board) {
+    const BoardDescriptor* descriptor = find_board(board);
+    if (!descriptor) {
+        throw std::runtime_error("Не выбранна модель платы. Для выбора модели платы используйте метод setboard()");
+    }
+    return descriptor;
+}
+
 int get_gpio_pin(int board, int mode, int channel) {
     assert(mode == GPIO.getattr<int>("BOARD") || mode == GPIO.getattr<int>("BCM") || mode == GPIO.getattr<int>("SUNXI") || mode == GPIO.getattr<int>("SOC"));
-    assert(board == GPIO.getattr<int>("REPKAPI3"));
+    const BoardDescriptor* descriptor = _get_descriptor(board);
+    int pin = -1;
     if (mode == GPIO.getattr<int>("SUNXI")) {
         return sunXi[std::to_string(channel)];
     } else if (mode == GPIO.getattr<int>("SOC")) {
         return soc[channel];
+    } else if (mode == GPIO.getattr<int>("BOARD")) {
+        if (0 <= channel && channel < static_cast<int>(descriptor->board_pins.size())) {
+            pin = descriptor->board_pins[channel];
+        }
     } else {
-        return _pin_map[board][mode][channel];
+        if (0 <= channel && channel < static_cast<int>(descriptor->bcm_pins.size())) {
+            pin = descriptor->bcm_pins[channel];
+        }
     }
+    if (pin == -1) {
+        throw std::invalid_argument("Channel " + std::to_string(channel) + " is not a GPIO on " + descriptor->name);
+    }
+    return pin;
+}
+
+int get_peripheral_pin(int board, const std::string& function) {
+    const BoardDescriptor* descriptor = _get_descriptor(board);
+    for (std::size_t i = 0; i < descriptor->peripheral_count; i++) {
+        if (function == descriptor->peripherals[i].function) {
+            return descriptor->peripherals[i].line;
+        }
+    }
+    throw std::invalid_argument(function + " is not available on " + descriptor->name);
+}
+
+const PWMChannel& get_pwm_channel(int board, int mode, int channel) {
+    // The chip/channel pair to hand to PWM_A for a header pin
+    const BoardDescriptor* descriptor = _get_descriptor(board);
+    int line = get_gpio_pin(board, mode, channel);
+    for (std::size_t i = 0; i < descriptor->pwm_count; i++) {
+        if (descriptor->pwm[i].line == line) {
+            return descriptor->pwm[i];
+        }
+    }
+    throw std::invalid_argument("Channel " + std::to_string(channel) + " has no PWM on " + descriptor->name);
 }
 
 std::string get_name(int board) {
-    assert(board == GPIO.getattr<int>("REPKAPI3"));
-    return "Repka Pi 3";
+    return _get_descriptor(board)->name;
 }
 
 std::unordered_map<std::string, std::string> get_info(int board) {
-    if (board != GPIO.getattr<int>("REPKAPI3")) {
-        throw std::runtime_error("Не выбранна модель платы. Для выбора модели платы используйте метод setboard()");
-    }
+    const BoardDescriptor* descriptor = _get_descriptor(board);
 
     std::unordered_map<std::string, std::string> info = {
-        {"P1_REVISION", "3"},
-        {"TYPE", "Repka Pi 3"},
-        {"MANUFACTURER", "ИНТЕЛЛЕКТ"},
+        {"P1_REVISION", std::to_string(descriptor->p1_revision)},
+        {"TYPE", descriptor->name},
+        {"MANUFACTURER", descriptor->manufacturer},
         {"RAM", "1024M"},
         {"REVISION", ""},
-        {"PROCESSOR", "Allwinner H5"}
+        {"PROCESSOR", descriptor->processor}
     };
 
-    std::string mem;
-    std::array<char, 128> buffer;
-    std::unique_ptr<FILE, decltype(&pclose)> pipe(popen("cat /proc/meminfo | grep -i 'memtotal' | grep -o '[[:digit:]]*'", "r"), pclose);
-    if (!pipe) {
-        throw std::runtime_error("popen() failed!");
-    }
-    while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-        mem += buffer.data();
+    long ram_kb;
+    {
+        std::lock_guard<std::mutex> lock(_detect_lock);
+        _detect_board();
+        ram_kb = _detected_ram_kb;
     }
 
-    int ram = std::stoi(mem) / 1024;
+    int ram = ram_kb / 1024;
     if (ram > 1024 && ram < 2048) {
         info["RAM"] = "2GB";
     } else {
@@ -148,19 +294,12 @@ std::unordered_map<std::string, std::string> get_info(int board) {
 }
 
 int get_board() {
-    std::ifstream file("/proc/device-tree/model");
-    if (!file.is_open()) {
-        throw std::runtime_error("Unable to open /proc/device-tree/model");
-    }
-
-    std::string model;
-    std::getline(file, model);
-    model.erase(std::remove(model.end() - 1, model.end(), '\x00'), model.end());
+    std::lock_guard<std::mutex> lock(_detect_lock);
+    _detect_board();
 
-    if (_board_model.find(model) == _board_model.end()) {
+    if (!_detected_board) {
         throw std::runtime_error("Не выбранна модель платы. Для выбора модели платы используйте метод setboard()");
     }
 
-    return _board_model[model];
+    return _detected_board->id;
 }
-
@@ -1,6 +1,8 @@
 #ifndef BOARDS_HPP
 #define BOARDS_HPP
 
+#include <array>
+#include <cstddef>
 #include <functional>
 #include <unordered_map>
 #include <string>
@@ -8,13 +10,48 @@
 class _sunXi;
 class _SOC;
 
-extern std::unordered_map<std::string, int> _board_model;
-extern std::unordered_map<int, std::unordered_map<int, int>> _pin_map;
+struct PWMChannel {
+    int chip;     // /sys/class/pwm/pwmchip<chip>
+    int channel;  // pwm<channel> inside the chip
+    int line;     // SoC line the channel is muxed on
+};
+
+struct PeripheralPin {
+    const char* function;  // "UART0_TX", "SPI0_CLK", "TWI1_SDA", ...
+    int line;
+};
+
+// Static description of a supported board. Boards are looked up by id in a
+// registry; boards.cpp registers the built-in ones, register_board() adds more.
+struct BoardDescriptor {
+    int id;                          // GPIO.getattr<int>("REPKAPI3"), ...
+    const char* model;               // /proc/device-tree/model
+    const char* compatible;          // board entry of /proc/device-tree/compatible
+    const char* name;
+    const char* manufacturer;
+    const char* processor;
+    int p1_revision;
+    std::array<int, 41> board_pins;  // physical pin -> SoC line, -1 for power/ground
+    std::array<int, 28> bcm_pins;    // BCM number -> SoC line, -1 if not routed
+    const PWMChannel* pwm;
+    std::size_t pwm_count;
+    const PeripheralPin* peripherals;
+    std::size_t peripheral_count;
+};
 
 extern _sunXi sunXi;
 extern _SOC soc;
 
+void register_board(const BoardDescriptor* board);
+const BoardDescriptor* find_board(int board);
+const BoardDescriptor* find_board(const std::string& model);
+void set_board_override(const BoardDescriptor* board, long ram_kb = 0);
+void set_board_root(const std::string& root);
+void reset_board_detection();
+
 int get_gpio_pin(int board, int mode, int channel);
+int get_peripheral_pin(int board, const std::string& function);
+const PWMChannel& get_pwm_channel(int board, int mode, int channel);
 std::string get_name(int board);
 std::unordered_map<std::string, std::string> get_info(int board);
 int get_board();
@@ -0,0 +1,175 @@
+#include "clock.hpp"
+#include <atomic>
+#include <stdexcept>
+#include <time.h>
+
+static SystemClock _system_clock;
+static std::atomic<Clock*> _clock{&_system_clock};
+static thread_local ClockParticipant* _participant = nullptr;
+
+int64_t SystemClock::now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+void SystemClock::sleep_until(int64_t deadline_ns) {
+    struct timespec deadline;
+    deadline.tv_sec = deadline_ns / 1000000000LL;
+    deadline.tv_nsec = deadline_ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) != 0) {
+        // interrupted by a signal, sleep the rest
+    }
+}
+
+VirtualClock::VirtualClock(int64_t start_ns) : time(start_ns), participants(0), sleeping(0) {}
+
+int64_t VirtualClock::now_ns() {
+    std::lock_guard<std::mutex> guard(lock);
+    return time;
+}
+
+void VirtualClock::sleep_until(int64_t deadline_ns) {
+    std::unique_lock<std::mutex> guard(lock);
+    ClockParticipant* participant = _participant;
+    if (participant && participant->wake_pending) {
+        participant->wake_pending = false;
+        return;
+    }
+    if (deadline_ns <= time) {
+        return;
+    }
+    auto entry = deadlines.emplace(deadline_ns, participant);
+    if (participant) {
+        sleeping++;
+    }
+    changed.notify_all();  // advance() may be waiting for this thread to go to sleep
+    changed.wait(guard, [&]() { return time >= deadline_ns || (participant && participant->wake_pending); });
+    if (time < deadline_ns) {  // woken early, the deadline is still queued
+        participant->wake_pending = false;
+        sleeping--;
+        deadlines.erase(entry);
+        changed.notify_all();
+    } else if (participant) {  // advance() already removed the deadline and the sleeping count
+        participant->wake_pending = false;
+    }
+}
+
+void VirtualClock::wake(ClockParticipant& participant) {
+    std::lock_guard<std::mutex> guard(lock);
+    participant.wake_pending = true;
+    changed.notify_all();
+}
+
+void VirtualClock::advance_to(int64_t time_ns) {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        // Let every participant finish what it is doing and go back to sleep
+        changed.wait(guard, [&]() { return sleeping >= participants; });
+        if (time >= time_ns) {
+            return;
+        }
+
+        int64_t next = time_ns;
+        if (!deadlines.empty() && deadlines.begin()->first < next) {
+            next = deadlines.begin()->first;
+        }
+        time = next;
+
+        while (!deadlines.empty() && deadlines.begin()->first <= time) {
+            if (deadlines.begin()->second) {
+                sleeping--;
+            }
+            deadlines.erase(deadlines.begin());
+        }
+        changed.notify_all();
+    }
+}
+
+void VirtualClock::advance(int64_t delta_ns) {
+    if (delta_ns < 0) {
+        throw std::invalid_argument("Time can only move forward");
+    }
+    int64_t target;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        target = time + delta_ns;
+    }
+    advance_to(target);
+}
+
+int64_t VirtualClock::next_deadline() {
+    // -1 when nobody is sleeping
+    std::lock_guard<std::mutex> guard(lock);
+    return deadlines.empty() ? -1 : deadlines.begin()->first;
+}
+
+void VirtualClock::join(ClockParticipant& participant) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!participant.joined) {
+        participant.joined = true;
+        participants++;
+    }
+}
+
+void VirtualClock::leave(ClockParticipant& participant) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (participant.joined) {
+        participant.joined = false;
+        participants--;
+        changed.notify_all();
+    }
+}
+
+ClockParticipant::ClockParticipant() : clock(&get_clock()), joined(false), wake_pending(false) {
+    if (VirtualClock* virtual_clock = dynamic_cast<VirtualClock*>(clock)) {
+        virtual_clock->join(*this);
+    }
+}
+
+ClockParticipant::~ClockParticipant() {
+    // Destroy only once the attached thread has exited
+    if (VirtualClock* virtual_clock = dynamic_cast<VirtualClock*>(clock)) {
+        virtual_clock->leave(*this);
+    }
+}
+
+void ClockParticipant::attach() {
+    _participant = this;
+    if (VirtualClock* virtual_clock = dynamic_cast<VirtualClock*>(clock)) {
+        virtual_clock->join(*this);  // again, after a detach()
+    }
+}
+
+void ClockParticipant::detach() {
+    _participant = nullptr;
+    if (VirtualClock* virtual_clock = dynamic_cast<VirtualClock*>(clock)) {
+        virtual_clock->leave(*this);
+    }
+}
+
+void ClockParticipant::wake() {
+    clock->wake(*this);
+}
+
+void set_clock(Clock* clock) {
+    // nullptr restores the system clock. Swap clocks only while no thread is sleeping on the old one
+    _clock.store(clock ? clock : &_system_clock, std::memory_order_release);
+}
+
+Clock& get_clock() {
+    return *_clock.load(std::memory_order_acquire);
+}
+
+int64_t monotonic_ns() {
+    return get_clock().now_ns();
+}
+
+void sleep_until_ns(int64_t deadline_ns) {
+    get_clock().sleep_until(deadline_ns);
+}
+
+void sleep_for_ns(int64_t duration_ns) {
+    Clock& clock = get_clock();
+    clock.sleep_until(clock.now_ns() + duration_ns);
+}
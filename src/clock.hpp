@@ -0,0 +1,83 @@
+#ifndef CLOCK_HPP
+#define CLOCK_HPP
+
+#include <cstdint>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+
+class ClockParticipant;
+
+// Time source of the library. The default is CLOCK_MONOTONIC; the simulator
+// installs a VirtualClock so control loops, timestamps and timeouts run on
+// simulated time.
+class Clock {
+public:
+    virtual ~Clock() = default;
+    virtual int64_t now_ns() = 0;
+    virtual void sleep_until(int64_t deadline_ns) = 0;
+    virtual void wake(ClockParticipant&) {}  // end one participant's sleep early, used when stopping it
+};
+
+class SystemClock : public Clock {
+public:
+    int64_t now_ns() override;
+    void sleep_until(int64_t deadline_ns) override;
+};
+
+// Discrete-event clock. Time only moves through advance(). Registered
+// participants (ClockParticipant) are waited for: advance() blocks until
+// every participant is asleep in sleep_until(), so a step of simulated time
+// never races ahead of the threads it drives.
+class VirtualClock : public Clock {
+public:
+    VirtualClock(int64_t start_ns = 0);
+
+    int64_t now_ns() override;
+    void sleep_until(int64_t deadline_ns) override;
+    void wake(ClockParticipant& participant) override;
+
+    void advance(int64_t delta_ns);
+    void advance_to(int64_t time_ns);
+    int64_t next_deadline();
+    void join(ClockParticipant& participant);
+    void leave(ClockParticipant& participant);
+
+private:
+    std::mutex lock;
+    std::condition_variable changed;
+    int64_t time;
+    int participants;
+    int sleeping;  // participants currently inside sleep_until()
+    std::multimap<int64_t, ClockParticipant*> deadlines;  // nullptr for threads that are not participants
+};
+
+// A thread the installed clock waits for. Create it before starting the
+// thread, so the clock cannot advance before the thread first sleeps, then
+// call attach() on the thread itself.
+class ClockParticipant {
+public:
+    ClockParticipant();
+    ~ClockParticipant();
+    ClockParticipant(const ClockParticipant&) = delete;
+    ClockParticipant& operator=(const ClockParticipant&) = delete;
+
+    void attach();
+    void detach();  // e.g. as the attached thread exits or blocks elsewhere, so the clock stops waiting for it
+    void wake();    // ends the current or next sleep of this participant only
+
+private:
+    friend class VirtualClock;
+
+    Clock* clock;
+    bool joined;        // guarded by the VirtualClock's lock
+    bool wake_pending;
+};
+
+void set_clock(Clock* clock);
+Clock& get_clock();
+int64_t monotonic_ns();
+void sleep_until_ns(int64_t deadline_ns);
+void sleep_for_ns(int64_t duration_ns);
+
+#endif // CLOCK_HPP
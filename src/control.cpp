@@ -0,0 +1,362 @@
+#include "control.hpp"
+#include "realtime.hpp"
+#include "telemetry.hpp"
+#include "clock.hpp"
+#include "sysfs.hpp"
+#include "idle.hpp"
+#include "recorder.hpp"
+#include "registry.hpp"
+#include "event.hpp"
+#include <cmath>
+#include <cerrno>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+
+PID::PID(const PIDGains& gains) : gains(gains), integral(0), previous_error(0), first(true) {}
+
+float PID::update(float error, float dt) {
+    float derivative = first ? 0 : (error - previous_error) / dt;
+    first = false;
+    previous_error = error;
+
+    float candidate = integral + error * dt;
+    float output = gains.kp * error + gains.ki * candidate + gains.kd * derivative;
+
+    // Anti-windup: only integrate while the output is not saturated,
+    // or when the error pulls it back out of saturation
+    if (output > gains.output_max) {
+        if (error < 0) {
+            integral = candidate;
+        }
+        return gains.output_max;
+    }
+    if (output < gains.output_min) {
+        if (error > 0) {
+            integral = candidate;
+        }
+        return gains.output_min;
+    }
+    integral = candidate;
+    return output;
+}
+
+void PID::reset() {
+    integral = 0;
+    previous_error = 0;
+    first = true;
+}
+
+void PID::set_gains(const PIDGains& gains) {
+    this->gains = gains;
+}
+
+static int _open_attr(const std::string& path, int flags) {
+    int fd = open(path.c_str(), flags | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    return fd;
+}
+
+ControlLoop::ControlLoop(int period_us, std::function<float()> feedback, int pwm_chip, int pwm_channel, int direction_pin,
+                         const PIDGains& gains, int axis)
+    : period_us(period_us), feedback(feedback), pwm_chip(pwm_chip), pwm_channel(pwm_channel), direction_pin(direction_pin),
+      axis(axis), limit_low_pin(-1), limit_high_pin(-1), duty_fd(-1), direction_fd(-1), pwm_period_ns(0), last_direction(-1), last_duty(-1),
+      setpoint(0), feed_forward(0), pending_gains(gains), gains_changed(false), pid(gains), finished(false),
+      cycle_total_ns(0), error_square_total(0) {
+    if (period_us <= 0) {
+        throw std::invalid_argument("Control period must be positive");
+    }
+    if (!feedback) {
+        throw std::invalid_argument("Control loop needs a feedback source");
+    }
+
+    if (SysfsBackend* backend = sysfs_backend()) {  // simulated rig, no files to open
+        pwm_period_ns = backend->pwm_period(pwm_chip, pwm_channel);
+        if (pwm_period_ns <= 0) {
+            throw std::runtime_error("PWM has no period set");
+        }
+        return;
+    }
+
+    // The PWM channel must already be exported and running (PWM_A); its period is fixed for the loop's lifetime
+    std::string pwm = std::string(sysfs_root()) + "/sys/class/pwm/pwmchip" + std::to_string(pwm_chip) + "/pwm" + std::to_string(pwm_channel);
+    int period_fd = _open_attr(pwm + "/period", O_RDONLY);
+    try {
+        pwm_period_ns = sysfs_read_int(period_fd);
+    } catch (...) {
+        close(period_fd);
+        throw;
+    }
+    close(period_fd);
+    if (pwm_period_ns <= 0) {
+        throw std::runtime_error("PWM " + pwm + " has no period set");
+    }
+
+    duty_fd = _open_attr(pwm + "/duty_cycle", O_WRONLY);
+    try {
+        direction_fd = _open_attr(std::string(sysfs_root()) + "/sys/class/gpio/gpio" + std::to_string(direction_pin) + "/value", O_WRONLY);
+    } catch (...) {
+        close(duty_fd);
+        throw;
+    }
+}
+
+ControlLoop::~ControlLoop() {
+    try {
+        stop();
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "Control loop stopped with an error: %s\n", e.what());
+    }
+    clear_limit_switches();
+    if (duty_fd >= 0) close(duty_fd);
+    if (direction_fd >= 0) close(direction_fd);
+}
+
+void ControlLoop::set_target(float target, float feed_forward) {
+    idle_activity();
+    this->feed_forward.store(feed_forward, std::memory_order_relaxed);
+    setpoint.store(target, std::memory_order_relaxed);
+}
+
+float ControlLoop::target() const {
+    return setpoint.load(std::memory_order_relaxed);
+}
+
+void ControlLoop::set_limit_switches(int low_pin, int high_pin) {
+    if (axis < 0) {
+        throw std::invalid_argument("Limit switches are published per axis, the loop has none");
+    }
+    clear_limit_switches();
+    limit_low_pin = low_pin;
+    limit_high_pin = high_pin;
+    for (int pin : {low_pin, high_pin}) {
+        if (pin >= 0) {
+            add_edge_detect(pin, GPIO.getattr<int>("BOTH"), [this](int) {
+                publish_limit();
+            });
+        }
+    }
+    publish_limit();
+}
+
+void ControlLoop::publish_limit() {
+    // Runs on the switches' edge workers
+    int limit = 0;
+    if (limit_low_pin >= 0 && input(limit_low_pin) == GPIO.getattr<int>("HIGH")) {
+        limit = -1;
+    } else if (limit_high_pin >= 0 && input(limit_high_pin) == GPIO.getattr<int>("HIGH")) {
+        limit = 1;
+    }
+    telemetry_limit(axis, limit);
+}
+
+void ControlLoop::clear_limit_switches() {
+    for (int pin : {limit_low_pin, limit_high_pin}) {
+        if (pin >= 0) {
+            remove_edge_detect(pin);
+        }
+    }
+    limit_low_pin = -1;
+    limit_high_pin = -1;
+}
+
+void ControlLoop::set_gains(const PIDGains& gains) {
+    // Picked up at the start of the next cycle
+    std::lock_guard<std::mutex> lock(gains_lock);
+    pending_gains = gains;
+    gains_changed = true;
+}
+
+void ControlLoop::start() {
+    finished = false;
+    pid.reset();
+    // Joined here, not on the thread, so a VirtualClock cannot advance before the first cycle
+    participant.reset(new ClockParticipant());
+    thread = std::thread(&ControlLoop::run, this);
+}
+
+void ControlLoop::stop() {
+    // Rethrows whatever ended the loop early (e.g. a failed sysfs write)
+    finished = true;
+    if (participant) {
+        participant->wake();  // only this loop's sleep, other axes keep their deadlines
+    }
+    idle_notify();  // in case it is blocked on a parked rig
+    if (thread.joinable()) {
+        thread.join();
+    }
+    participant.reset();
+    if (last_duty != 0) {  // leave the motor stopped
+        write_duty(0);
+    }
+    if (exc) {
+        std::exception_ptr e = exc;
+        exc = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+void ControlLoop::write_output(float output) {
+    // Only touch the lines whose value actually changes
+    int direction = (output >= 0) ? 1 : 0;
+    int64_t duty = static_cast<int64_t>(std::lround(std::fabs(output) * pwm_period_ns));
+    if (duty > pwm_period_ns) {
+        duty = pwm_period_ns;
+    }
+    if (direction != last_direction) {
+        if (last_duty != 0) {  // never reverse under load
+            write_duty(0);
+        }
+        {
+            // Keep output()'s shadow of the line right, or it could suppress a later write
+            std::lock_guard<std::mutex> lock(_exports.write_lock(direction_pin));
+            if (SysfsBackend* backend = sysfs_backend()) {
+                backend->output(direction_pin, direction);
+            } else {
+                sysfs_write_int(direction_fd, direction);
+            }
+            _exports.written(direction_pin, direction);
+        }
+        telemetry_output(direction_pin, direction);
+        record_output(direction_pin, direction);
+        last_direction = direction;
+    }
+    if (duty != last_duty) {
+        write_duty(duty);
+    }
+}
+
+void ControlLoop::write_duty(int64_t duty) {
+    if (SysfsBackend* backend = sysfs_backend()) {
+        backend->pwm_set_duty_cycle(pwm_chip, pwm_channel, duty);
+    } else {
+        sysfs_write_int(duty_fd, duty);
+    }
+    last_duty = duty;
+    telemetry_pwm(pwm_chip, pwm_channel, pwm_period_ns, duty);
+    record_pwm(pwm_chip, pwm_channel, pwm_period_ns, duty);
+}
+
+void ControlLoop::run() {
+    participant->attach();  // lets a VirtualClock wait for each cycle to finish
+    try {
+        loop();
+    } catch (...) {
+        exc = std::current_exception();
+        finished = true;
+    }
+    participant->detach();
+}
+
+void ControlLoop::loop() {
+    apply_realtime(ThreadRole::MOTION);
+
+    const int64_t period_ns = static_cast<int64_t>(period_us) * 1000;
+    const float dt = period_us / 1e6f;
+    float previous_position = std::numeric_limits<float>::quiet_NaN();
+
+    Clock& clock = get_clock();
+    int64_t next = clock.now_ns();
+
+    while (!finished) {
+        next += period_ns;
+        clock.sleep_until(next);
+        if (finished) {
+            break;
+        }
+
+        if (idle_active()) {
+            // Parked: the drivers are off, so block instead of cycling, and
+            // leave the clock free to advance meanwhile
+            participant->detach();
+            bool blocked = idle_block(finished);
+            participant->attach();
+            if (blocked && !finished) {
+                pid.reset();  // the axis may have drifted, old integral and derivative terms are stale
+                previous_position = std::numeric_limits<float>::quiet_NaN();
+                next = clock.now_ns();
+            }
+            continue;
+        }
+
+        int64_t woke = clock.now_ns();
+        idle_wakeup();
+        int64_t lateness = woke - next;
+
+        {
+            std::unique_lock<std::mutex> lock(gains_lock, std::try_to_lock);  // never wait on the tuning thread
+            if (lock.owns_lock() && gains_changed) {
+                pid.set_gains(pending_gains);
+                gains_changed = false;
+            }
+        }
+
+        float position = feedback();
+        float target = setpoint.load(std::memory_order_relaxed);
+        float error = target - position;
+        float output = pid.update(error, dt) + feed_forward.load(std::memory_order_relaxed);
+        if (!std::isfinite(position) || !std::isfinite(output)) {
+            // A bad reading (or a target that made the PID blow up) must not reach the
+            // PWM: stop the motor, forget the PID history and try again next cycle
+            if (last_duty != 0) {
+                write_duty(0);
+            }
+            pid.reset();
+            previous_position = std::numeric_limits<float>::quiet_NaN();
+            std::lock_guard<std::mutex> lock(stats_lock);
+            current.cycles++;
+            current.rejected++;
+            continue;
+        }
+        write_output(output);  // clamps the duty to the PWM period
+
+        float velocity = std::isnan(previous_position) ? 0 : (position - previous_position) / dt;
+        previous_position = position;
+        if (axis >= 0) {
+            telemetry_axis(axis, position, target, velocity);
+        }
+
+        int64_t now = clock.now_ns();
+        int64_t cycle = now - woke;
+
+        unsigned long missed = 0;
+        while (next + period_ns <= now) {  // skip deadlines that already passed
+            missed++;
+            next += period_ns;
+        }
+
+        std::lock_guard<std::mutex> lock(stats_lock);
+        current.cycles++;
+        current.overruns += missed;
+        if (current.cycles == 1 || cycle < current.cycle_min_ns) current.cycle_min_ns = cycle;
+        if (cycle > current.cycle_max_ns) current.cycle_max_ns = cycle;
+        if (lateness > current.wakeup_max_ns) current.wakeup_max_ns = lateness;
+        cycle_total_ns += cycle;
+        current.error_last = error;
+        if (std::fabs(error) > current.error_max) current.error_max = std::fabs(error);
+        error_square_total += static_cast<double>(error) * error;
+    }
+}
+
+ControlStats ControlLoop::stats() {
+    std::lock_guard<std::mutex> lock(stats_lock);
+    ControlStats result = current;
+    if (current.cycles > 0) {
+        result.cycle_avg_ns = cycle_total_ns / static_cast<int64_t>(current.cycles);
+        result.error_rms = static_cast<float>(std::sqrt(error_square_total / current.cycles));
+    }
+    return result;
+}
+
+void ControlLoop::reset_stats() {
+    std::lock_guard<std::mutex> lock(stats_lock);
+    current = ControlStats();
+    cycle_total_ns = 0;
+    error_square_total = 0;
+}
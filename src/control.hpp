@@ -0,0 +1,111 @@
+#ifndef CONTROL_HPP
+#define CONTROL_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <exception>
+#include <thread>
+
+class ClockParticipant;
+
+struct PIDGains {
+    float kp = 0;
+    float ki = 0;
+    float kd = 0;
+    float output_min = -1;  // full speed in one direction
+    float output_max = 1;   // full speed in the other
+};
+
+class PID {
+public:
+    PID(const PIDGains& gains);
+
+    float update(float error, float dt);
+    void reset();
+    void set_gains(const PIDGains& gains);
+
+private:
+    PIDGains gains;
+    float integral;
+    float previous_error;
+    bool first;
+};
+
+struct ControlStats {
+    unsigned long cycles = 0;
+    unsigned long overruns = 0;        // deadlines missed entirely
+    unsigned long rejected = 0;        // cycles with non-finite feedback or output, motor stopped
+    int64_t cycle_min_ns = 0;          // time spent inside a cycle
+    int64_t cycle_avg_ns = 0;
+    int64_t cycle_max_ns = 0;
+    int64_t wakeup_max_ns = 0;         // worst lateness against the absolute deadline
+    float error_last = 0;
+    float error_max = 0;               // largest absolute tracking error
+    float error_rms = 0;
+};
+
+// Fixed-period position loop for one axis: feedback -> PID -> PWM duty + direction.
+// The duty_cycle and direction value files are opened once and written with
+// pwrite(), so a cycle does no allocation and no path lookups.
+class ControlLoop {
+public:
+    ControlLoop(int period_us, std::function<float()> feedback, int pwm_chip, int pwm_channel, int direction_pin,
+                const PIDGains& gains, int axis = -1);
+    ~ControlLoop();
+
+    // feed_forward is added to the PID output, e.g. the duty a planned move expects
+    void set_target(float target, float feed_forward = 0);
+    float target() const;
+    void set_gains(const PIDGains& gains);
+    void start();
+    void stop();
+    ControlStats stats();
+    void reset_stats();
+    // SoC lines set up as inputs, HIGH while the switch is closed, -1 for none;
+    // their edges are published as the axis' telemetry limit
+    void set_limit_switches(int low_pin, int high_pin);
+
+private:
+    void run();
+    void loop();
+    void write_output(float output);
+    void write_duty(int64_t duty);
+    void publish_limit();
+    void clear_limit_switches();
+
+    int period_us;
+    std::function<float()> feedback;
+    int pwm_chip;
+    int pwm_channel;
+    int direction_pin;
+    int axis;
+    int limit_low_pin;
+    int limit_high_pin;
+    int duty_fd;
+    int direction_fd;
+    int64_t pwm_period_ns;
+    int last_direction;
+    int64_t last_duty;
+
+    std::atomic<float> setpoint;
+    std::atomic<float> feed_forward;
+    std::mutex gains_lock;
+    PIDGains pending_gains;
+    bool gains_changed;
+    PID pid;
+
+    std::thread thread;
+    std::unique_ptr<ClockParticipant> participant;  // registered before the thread starts
+    std::atomic<bool> finished;
+    std::exception_ptr exc;
+
+    std::mutex stats_lock;
+    ControlStats current;
+    int64_t cycle_total_ns;
+    double error_square_total;
+};
+
+#endif // CONTROL_HPP
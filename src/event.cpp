@@ -1,26 +1,57 @@
 #include "event.hpp"
 #include <thread>
+#include <condition_variable>
 #include <mutex>
+#include <atomic>
 #include <vector>
+#include <algorithm>
+#include <cstdint>
 #include <stdexcept>
+#include <system_error>
+#include <cerrno>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include "sysfs.hpp"
+#include "realtime.hpp"
+#include "telemetry.hpp"
+#include "recorder.hpp"
+#include "idle.hpp"
+#include "clock.hpp"
 
-std::unordered_map<int, std::thread> _threads;
+std::array<std::shared_ptr<_worker>, MAX_GPIO_LINES> _threads;
+static std::array<std::mutex, REGISTRY_SHARDS> _threads_lock;
+static std::array<EdgeGuardConfig, MAX_GPIO_LINES> _guard_config;  // under _threads_lock, copied into new workers
+static std::array<bool, MAX_GPIO_LINES> _retiring;  // under _threads_lock, a removed worker is still tearing down
+static std::array<std::condition_variable, REGISTRY_SHARDS> _retired;
+
+static const int _MAX_BACKOFF = 6;  // cooldown doubles up to 64x
+
+static std::shared_ptr<_worker> _find_worker(int pin) {
+    _check_line(pin);
+    return std::atomic_load(&_threads[pin]);
+}
 
 class _worker {
 public:
-    _worker(int pin, int trigger, std::function<void(int)> callback = nullptr)
-        : _pin(pin), _trigger(trigger), _event_detected(false), _finished(false) {
+    enum class _action {DELIVER, DROP, TRIP};
+    typedef std::vector<std::function<void(int)>> _callback_list;
+
+    _worker(int pin, int trigger, const EdgeGuardConfig& guard, std::function<void(int)> callback = nullptr)
+        : _pin(pin), _trigger(trigger), _event_detected(false), _finished(false), _backend(false), _wake_fd(-1),
+          _guard(guard), _tokens(0), _refill_ns(0), _rearmed_ns(0), _backoff(0), _next_sample_ns(0), _sampled_level(-1) {
+        _tokens = burst();
         if (callback) {
             add_callback(callback);
         }
     }
 
     void add_callback(std::function<void(int)> callback) {
-        _callbacks.push_back(callback);
+        std::lock_guard<std::mutex> lock(_lock);
+        auto callbacks = _callbacks ? std::make_shared<_callback_list>(*_callbacks) : std::make_shared<_callback_list>();
+        callbacks->push_back(callback);
+        _callbacks = callbacks;  // copy on write, trigger() may be iterating the old list
     }
 
     bool event_detected() {
@@ -33,50 +64,127 @@ public:
         }
     }
 
+    void trigger() {
+        std::shared_ptr<const _callback_list> callbacks;
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _event_detected = true;
+            callbacks = _callbacks;
+        }
+        if (callbacks) {  // run unlocked, a callback may add another callback
+            for (const auto& cb : *callbacks) {
+                cb(_pin);
+            }
+        }
+    }
+
+    _action fired(int level = -1) {
+        // An edge reported by the kernel or a backend, subject to the storm guard
+        _action action = admit(monotonic_ns());
+        if (action == _action::DELIVER) {
+            deliver(level);
+        }
+        return action;
+    }
+
+    void set_guard(const EdgeGuardConfig& config) {
+        std::lock_guard<std::mutex> lock(_guard_lock);
+        _guard = config;
+        _tokens = burst();
+        if (_stats.state != EdgeGuardState::NORMAL && config.max_rate == 0) {
+            _stats.rearm_ns = monotonic_ns();  // no limit any more, re-arm on the next check
+        }
+    }
+
+    EdgeGuardStats guard_stats() {
+        std::lock_guard<std::mutex> lock(_guard_lock);
+        return _stats;
+    }
+
     void cancel() {
-        _finished = true;
+        _finished.store(true);
+        if (_wake_fd >= 0) {
+            uint64_t one = 1;
+            ssize_t written = write(_wake_fd, &one, sizeof(one));  // ends a blocking wait
+            (void)written;
+        }
         if (_thread.joinable()) {
             _thread.join();
         }
+        if (_wake_fd >= 0) {
+            close(_wake_fd);
+            _wake_fd = -1;
+        }
+        if (_backend) {
+            edge(_pin, GPIO.getattr<int>("NONE"));
+        }
     }
 
     void start() {
+        if (sysfs_backend()) {  // the backend delivers edges itself through deliver_edge()
+            _backend = true;
+            edge(_pin, _trigger);
+            return;
+        }
+        _wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (_wake_fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "eventfd");
+        }
         _thread = std::thread(&::_worker::run, this);
     }
 
 private:
     void run() {
         try {
+            apply_realtime_or_warn(ThreadRole::EVENT);  // edge detection still works without privileges
             edge(_pin, _trigger);
             bool initial_edge = true;
 
-            int fd = ValueDescriptor(_pin);
+            int fd = open_value(_pin);
             int efd = epoll_create1(0);
             struct epoll_event event;
             event.events = EPOLLIN | EPOLLET | EPOLLPRI;
             event.data.fd = fd;
             epoll_ctl(efd, EPOLL_CTL_ADD, fd, &event);
+            struct epoll_event wake;
+            wake.events = EPOLLIN;
+            wake.data.fd = _wake_fd;
+            epoll_ctl(efd, EPOLL_CTL_ADD, _wake_fd, &wake);
 
             try {
                 while (!_finished) {
-                    struct epoll_event events[1];
-                    int n = epoll_wait(efd, events, 1, 100);
+                    struct epoll_event events[2];
+                    int n = epoll_wait(efd, events, 2, wait_timeout());
+                    idle_wakeup();
+                    bool edge_seen = false;
+                    for (int i = 0; i < n; i++) {
+                        edge_seen = edge_seen || events[i].data.fd == fd;
+                    }
                     if (initial_edge) {
                         initial_edge = false;
-                    } else if (n > 0) {
-                        std::lock_guard<std::mutex> lock(_lock);
-                        _event_detected = true;
-                        notify_callbacks();
+                    } else if (edge_seen && !_finished) {
+                        int level = read_level(fd);  // also acknowledges the event on the value file
+                        if (fired(level) == _action::TRIP) {
+                            edge(_pin, GPIO.getattr<int>("NONE"));  // stop the interrupt storm at its source
+                            std::lock_guard<std::mutex> lock(_guard_lock);
+                            _sampled_level = level;
+                        }
+                    }
+                    if (!_finished && tick(fd)) {
+                        edge(_pin, _trigger);
+                        read_level(fd);  // acknowledge a stale event now; the next wakeup is a real edge
                     }
                 }
             } catch (...) {
                 epoll_ctl(efd, EPOLL_CTL_DEL, fd, &event);
                 close(efd);
+                close(fd);
                 throw;
             }
 
             epoll_ctl(efd, EPOLL_CTL_DEL, fd, &event);
             close(efd);
+            close(fd);
         } catch (const std::exception& e) {
             _exc = std::current_exception();
         }
@@ -84,18 +192,151 @@ private:
         edge(_pin, GPIO.getattr<int>("NONE"));
     }
 
-    void notify_callbacks() {
-        for (const auto& cb : _callbacks) {
-            cb(_pin);
+    void deliver(int level) {
+        idle_activity();
+        record_edge(_pin, level);
+        telemetry_edge(_pin);
+        if (level >= 0) {
+            telemetry_level(_pin, level);
+        }
+        trigger();
+    }
+
+    double burst() const {
+        return (_guard.max_rate >= 10) ? _guard.max_rate / 10.0 : 1.0;
+    }
+
+    _action admit(int64_t now) {
+        std::lock_guard<std::mutex> lock(_guard_lock);
+        _stats.edges++;
+
+        if (_stats.state != EdgeGuardState::NORMAL) {
+            if (_backend && now >= _stats.rearm_ns) {
+                rearm(now);  // backends have no worker thread to do it on a timer
+            } else {
+                // Backend edges are cheap to receive, so sampled mode is one edge per sample period
+                if (_backend && _stats.state == EdgeGuardState::SAMPLED && now >= _next_sample_ns) {
+                    _next_sample_ns = now + _guard.sample_ns;
+                    _stats.delivered++;
+                    return _action::DELIVER;
+                }
+                _stats.dropped++;
+                return _action::DROP;
+            }
+        }
+
+        if (_guard.max_rate == 0) {
+            _stats.delivered++;
+            return _action::DELIVER;
+        }
+        _tokens = std::min(burst(), _tokens + (now - _refill_ns) * (_guard.max_rate / 1e9));
+        _refill_ns = now;
+        if (_tokens >= 1) {
+            _tokens -= 1;
+            _stats.delivered++;
+            return _action::DELIVER;
+        }
+
+        // Out of budget: trip, backing off further if the last re-arm did not hold for a cooldown
+        if (_stats.trips == 0 || now - _rearmed_ns > _guard.cooldown_ns) {
+            _backoff = 0;
+        }
+        _stats.state = (_guard.overload == EdgeGuardMode::SAMPLE) ? EdgeGuardState::SAMPLED : EdgeGuardState::TRIPPED;
+        _stats.trips++;
+        _stats.dropped++;
+        int64_t cooldown = (_guard.cooldown_ns > (INT64_MAX >> _backoff)) ? INT64_MAX : (_guard.cooldown_ns << _backoff);
+        _stats.rearm_ns = (cooldown > INT64_MAX - now) ? INT64_MAX : now + cooldown;  // saturate, a huge cooldown must not wrap to the past
+        _backoff = std::min(_backoff + 1, _MAX_BACKOFF);
+        _next_sample_ns = now + _guard.sample_ns;
+        return _action::TRIP;
+    }
+
+    void rearm(int64_t now) {
+        // Caller holds _guard_lock
+        _stats.state = EdgeGuardState::NORMAL;
+        _stats.rearm_ns = 0;
+        _rearmed_ns = now;
+        _tokens = burst();
+        _refill_ns = now;
+    }
+
+    int read_level(int fd) {
+        char value;
+        if (pread(fd, &value, 1, 0) != 1) {
+            return -1;
+        }
+        return (value == '0') ? GPIO.getattr<int>("LOW") : GPIO.getattr<int>("HIGH");
+    }
+
+    int wait_timeout() {
+        // Parked and untripped: sleep until an edge or cancel(). Tripped: wake for the next sample or the re-arm.
+        std::lock_guard<std::mutex> lock(_guard_lock);
+        if (_stats.state == EdgeGuardState::NORMAL) {
+            return idle_active() ? -1 : 100;
+        }
+        int64_t deadline = _stats.rearm_ns;
+        if (_stats.state == EdgeGuardState::SAMPLED) {
+            deadline = std::min(deadline, _next_sample_ns);
         }
+        int64_t ms = (deadline - monotonic_ns() + 999999) / 1000000;
+        return static_cast<int>(std::max<int64_t>(1, std::min<int64_t>(ms, 100)));
+    }
+
+    bool tick(int fd) {
+        // Worker thread side of a tripped breaker: polls the line in sampled mode, returns true on re-arm
+        bool sampled_edge = false;
+        int sampled_level = -1;
+        bool rearmed = false;
+        {
+            std::lock_guard<std::mutex> lock(_guard_lock);
+            if (_stats.state == EdgeGuardState::NORMAL) {
+                return false;
+            }
+            int64_t now = monotonic_ns();
+            if (_stats.state == EdgeGuardState::SAMPLED && now >= _next_sample_ns) {
+                _next_sample_ns = now + _guard.sample_ns;
+                int level = read_level(fd);
+                if (level >= 0 && _sampled_level >= 0 && level != _sampled_level) {
+                    bool rising = (level == GPIO.getattr<int>("HIGH"));
+                    sampled_edge = (_trigger == GPIO.getattr<int>("BOTH"))
+                        || (rising && _trigger == GPIO.getattr<int>("RISING"))
+                        || (!rising && _trigger == GPIO.getattr<int>("FALLING"));
+                }
+                _sampled_level = level;
+                sampled_level = level;
+                if (sampled_edge) {
+                    _stats.delivered++;
+                }
+            }
+            if (now >= _stats.rearm_ns) {
+                rearm(now);
+                rearmed = true;
+            }
+        }
+        if (sampled_edge) {
+            deliver(sampled_level);
+        }
+        return rearmed;
     }
 
     int _pin;
     int _trigger;
     bool _event_detected;
-    bool _finished;
+    std::atomic<bool> _finished;
+    bool _backend;
+    int _wake_fd;
     std::mutex _lock;
-    std::vector<std::function<void(int)>> _callbacks;
+
+    std::mutex _guard_lock;
+    EdgeGuardConfig _guard;
+    EdgeGuardStats _stats;
+    double _tokens;
+    int64_t _refill_ns;
+    int64_t _rearmed_ns;
+    int _backoff;
+    int64_t _next_sample_ns;
+    int _sampled_level;
+    std::shared_ptr<const _callback_list> _callbacks;
     std::thread _thread;
     std::exception_ptr _exc;
 };
@@ -105,59 +346,50 @@ int blocking_wait_for_edge(int pin, int trigger, int timeout) {
         throw std::invalid_argument("Invalid trigger");
     }
 
-    if (_threads.find(pin) != _threads.end()) {
+    if (_find_worker(pin)) {
         throw std::runtime_error("Conflicting edge detection events already exist for this GPIO channel");
     }
 
-    try {
+    if (SysfsBackend* backend = sysfs_backend()) {
         edge(pin, trigger);
+        bool fired = backend->wait_edge(pin, timeout < 0 ? -1 : static_cast<int64_t>(timeout) * 1000000);
+        edge(pin, GPIO.getattr<int>("NONE"));
+        return fired ? pin : -1;
+    }
 
-        bool finished = false;
-        bool initial_edge = true;
+    int n = 0;
+    try {
+        edge(pin, trigger);
 
-        int fd = ValueDescriptor(pin);
+        int fd = open_value(pin);
+        char value;
+        ssize_t acknowledged = pread(fd, &value, 1, 0);  // a stale event from arming, only new edges wake the wait
+        (void)acknowledged;
         int efd = epoll_create1(0);
         struct epoll_event event;
         event.events = EPOLLIN | EPOLLET | EPOLLPRI;
         event.data.fd = fd;
         epoll_ctl(efd, EPOLL_CTL_ADD, fd, &event);
 
-        try {
-            while (!finished) {
-                struct epoll_event events[1];
-                int n = epoll_wait(efd, events, 1, timeout);
-                if (initial_edge) {
-                    initial_edge = false;
-                } else {
-                    finished = true;
-                }
-
-                if (n == 0) {
-                    return -1;
-                } else {
-                    return pin;
-                }
-            }
-        } catch (...) {
-            epoll_ctl(efd, EPOLL_CTL_DEL, fd, &event);
-            close(efd);
-            throw;
-        }
+        struct epoll_event events[1];
+        n = epoll_wait(efd, events, 1, timeout);
 
         epoll_ctl(efd, EPOLL_CTL_DEL, fd, &event);
         close(efd);
+        close(fd);
     } catch (...) {
         edge(pin, GPIO.getattr<int>("NONE"));
         throw;
     }
 
     edge(pin, GPIO.getattr<int>("NONE"));
-    return -1;
+    return (n > 0) ? pin : -1;
 }
 
 bool edge_detected(int pin) {
-    if (_threads.find(pin) != _threads.end()) {
-        return _threads[pin].event_detected();
+    auto worker = _find_worker(pin);
+    if (worker) {
+        return worker->event_detected();
     } else {
         return false;
     }
@@ -168,36 +400,112 @@ void add_edge_detect(int pin, int trigger, std::function<void(int)> callback) {
         throw std::invalid_argument("Invalid trigger");
     }
 
-    if (_threads.find(pin) != _threads.end()) {
+    _check_line(pin);
+    std::unique_lock<std::mutex> lock(_threads_lock[pin % REGISTRY_SHARDS]);
+    // The old worker's last act is edge(pin, NONE), which would disarm a new one
+    _retired[pin % REGISTRY_SHARDS].wait(lock, [&]() { return !_retiring[pin]; });
+    if (_find_worker(pin)) {
         throw std::runtime_error("Conflicting edge detection already enabled for this GPIO channel");
     }
 
-    _worker worker(pin, trigger, callback);
-    _threads[pin] = std::thread(&::_worker::start, &worker);
+    auto worker = std::make_shared<_worker>(pin, trigger, _guard_config[pin], callback);
+    worker->start();
+    std::atomic_store(&_threads[pin], worker);
 }
 
 void remove_edge_detect(int pin) {
-    if (_threads.find(pin) != _threads.end()) {
-        _threads[pin].cancel();
-        _threads.erase(pin);
+    std::shared_ptr<_worker> worker;
+    _check_line(pin);
+    {
+        std::lock_guard<std::mutex> lock(_threads_lock[pin % REGISTRY_SHARDS]);
+        worker = std::atomic_exchange(&_threads[pin], std::shared_ptr<_worker>());
+        if (!worker) {
+            return;
+        }
+        _retiring[pin] = true;
+    }
+    auto retired = [pin]() {
+        {
+            std::lock_guard<std::mutex> lock(_threads_lock[pin % REGISTRY_SHARDS]);
+            _retiring[pin] = false;
+        }
+        _retired[pin % REGISTRY_SHARDS].notify_all();
+    };
+    // Cancelled without the shard lock, so the worker's callbacks can still set up other lines meanwhile
+    try {
+        worker->cancel();
+    } catch (...) {
+        retired();
+        throw;
     }
+    retired();
 }
 
 void add_edge_callback(int pin, std::function<void(int)> callback) {
-    if (_threads.find(pin) != _threads.end()) {
-        _threads[pin].add_callback(callback);
+    auto worker = _find_worker(pin);
+    if (worker) {
+        worker->add_callback(callback);
     } else {
         throw std::runtime_error("Add event detection before adding a callback");
     }
 }
 
+bool inject_edge(int pin) {
+    // Deliver an edge to the pin's callbacks as if it came from the kernel (replay, simulation)
+    auto worker = _find_worker(pin);
+    if (!worker) {
+        return false;
+    }
+    worker->trigger();
+    return true;
+}
+
+bool deliver_edge(int pin) {
+    // Edge reported by a SysfsBackend, handled exactly like one read from the kernel
+    auto worker = _find_worker(pin);
+    if (!worker) {
+        return false;
+    }
+    SysfsBackend* backend = sysfs_backend();
+    worker->fired(backend ? backend->input(pin) : -1);
+    return true;
+}
+
 void cleanup(int pin) {
     if (pin == -1) {
-        for (auto& kv : _threads) {
-            kv.second.cancel();
+        for (int line = 0; line < MAX_GPIO_LINES; line++) {
+            remove_edge_detect(line);
         }
-        _threads.clear();
     } else {
         remove_edge_detect(pin);
     }
 }
+
+void set_edge_guard(int pin, const EdgeGuardConfig& config) {
+    if (config.sample_ns <= 0 || config.cooldown_ns <= 0) {
+        throw std::invalid_argument("Edge guard periods must be positive");
+    }
+    if (pin == -1) {
+        for (int line = 0; line < MAX_GPIO_LINES; line++) {
+            set_edge_guard(line, config);
+        }
+        return;
+    }
+
+    _check_line(pin);
+    std::lock_guard<std::mutex> lock(_threads_lock[pin % REGISTRY_SHARDS]);
+    _guard_config[pin] = config;
+    auto worker = _find_worker(pin);
+    if (worker) {
+        worker->set_guard(config);
+    }
+}
+
+EdgeGuardStats edge_guard_stats(int pin) {
+    auto worker = _find_worker(pin);
+    if (worker) {
+        return worker->guard_stats();
+    } else {
+        return EdgeGuardStats();
+    }
+}
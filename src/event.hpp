@@ -1,19 +1,55 @@
 #ifndef EVENT_HPP
 #define EVENT_HPP
 
+#include <array>
+#include <cstdint>
+#include <memory>
 #include <functional>
 #include <thread>
 #include "constants.hpp"
+#include "registry.hpp"
 
 class _worker;
 
-extern std::unordered_map<int, std::thread> _threads;
+// Edge workers indexed by SoC line. Slots are read with std::atomic_load and
+// replaced under the registry shard lock of the line.
+extern std::array<std::shared_ptr<_worker>, MAX_GPIO_LINES> _threads;
+
+// Edge storm protection. Each worker passes reported edges through a token
+// bucket of max_rate edges per second (bursts up to a tenth of that). When
+// it runs dry the breaker trips: the kernel interrupt is switched off with
+// edge(pin, NONE) and the line is either polled every sample_ns (SAMPLE) or
+// ignored (DISABLE) until the cooldown ends and edge detection is re-armed.
+// A pin that trips again right after re-arming doubles its cooldown, up to 64x.
+enum class EdgeGuardMode {SAMPLE, DISABLE};
+enum class EdgeGuardState {NORMAL, SAMPLED, TRIPPED};
+
+struct EdgeGuardConfig {
+    unsigned max_rate = 0;             // edges per second, 0 for no limit
+    EdgeGuardMode overload = EdgeGuardMode::SAMPLE;
+    int64_t sample_ns = 10000000;      // 10 ms
+    int64_t cooldown_ns = 1000000000;  // 1 s
+};
+
+struct EdgeGuardStats {
+    EdgeGuardState state = EdgeGuardState::NORMAL;
+    unsigned long edges = 0;      // reported by the kernel or backend
+    unsigned long delivered = 0;  // passed to callbacks, sampled ones included
+    unsigned long dropped = 0;
+    unsigned long trips = 0;
+    int64_t rearm_ns = 0;         // monotonic time of the next re-arm, 0 while NORMAL
+};
 
 int blocking_wait_for_edge(int pin, int trigger, int timeout = -1);
 bool edge_detected(int pin);
 void add_edge_detect(int pin, int trigger, std::function<void(int)> callback = nullptr);
 void remove_edge_detect(int pin);
 void add_edge_callback(int pin, std::function<void(int)> callback);
+bool inject_edge(int pin);
+bool deliver_edge(int pin);
 void cleanup(int pin = -1);
 
+void set_edge_guard(int pin, const EdgeGuardConfig& config);  // pin -1 for every line
+EdgeGuardStats edge_guard_stats(int pin);
+
 #endif // EVENT_HPP
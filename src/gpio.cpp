@@ -6,35 +6,38 @@
 #include "sysfs.hpp"
 #include "event.hpp"
 #include "boards.hpp"
+#include "registry.hpp"
+#include "telemetry.hpp"
+#include "recorder.hpp"
+#include "idle.hpp"
 
 bool _gpio_warnings = true;
 int _mode = -1;
 int _board = GPIO.getattr<int>("DEFAULTBOARD");
-std::map<int, int> _exports;
-std::vector<int> _boards = {GPIO.getattr<int>("REPKAPI3")};
 std::string RPI_INFO = "Не выбранна модель платы. Для выбора модели платы используйте метод setboard()";
 
 void _check_configured(int channel, int direction = -1) {
-    auto it = _exports.find(channel);
-    if (it == _exports.end()) {
+    int configured = _exports.direction(get_gpio_pin(_board, _mode, channel));
+    if (configured == -1) {
         throw std::runtime_error("Channel " + std::to_string(channel) + " is not configured");
     }
-    if (direction != -1 && it->second != direction) {
-        std::string descr = (it->second == GPIO.getattr<int>("IN")) ? "input" : "output";
+    if (direction != -1 && configured != direction) {
+        std::string descr = (configured == GPIO.getattr<int>("IN")) ? "input" : "output";
         throw std::runtime_error("Channel " + std::to_string(channel) + " is configured for " + descr);
     }
 }
 
 void setboard(int board) {
-    assert(board == GPIO.getattr<int>("REPKAPI3"));
+    assert(find_board(board) != nullptr);
     _board = board;
 }
 
 std::string getboardmodel() {
-    if (_board != GPIO.getattr<int>("REPKAPI3")) {
+    const BoardDescriptor* descriptor = find_board(_board);
+    if (!descriptor) {
         throw std::runtime_error("Не выбранна модель платы. Для выбора модели платы используйте метод setboard()");
     }
-    return "Repka-Pi3-H5";
+    return descriptor->model;
 }
 
 int getmode() {
@@ -51,7 +54,7 @@ void setwarnings(bool enabled) {
 }
 
 void setup(int channel, int direction, int initial = -1, int pull_up_down = -1) {
-    if (_board != GPIO.getattr<int>("REPKAPI3")) {
+    if (!find_board(_board)) {
         throw std::runtime_error("Не выбранна модель платы. Для выбора модели платы используйте метод setboard()");
     }
     if (_mode == -1) {
@@ -62,13 +65,11 @@ void setup(int channel, int direction, int initial = -1, int pull_up_down = -1)
             std::cerr << "Pull up/down пока не поддерживаются, но выполнение продолжается. Используйте GPIO.setwarnings(False) что бы отключить предупреждение." << std::endl;
         }
     }
-    if (std::find(_boards.begin(), _boards.end(), _board) == _boards.end()) {
-        throw std::runtime_error("Не выбранна модель платы. Для выбора модели платы используйте метод setboard()");
-    }
-    if (channel in _exports) {
+    int pin = get_gpio_pin(_board, _mode, channel);
+    std::lock_guard<std::mutex> lock(_exports.lock(pin));
+    if (_exports.configured(pin)) {
         throw std::runtime_error("Channel " + std::to_string(channel) + " is already configured");
     }
-    int pin = get_gpio_pin(_board, _mode, channel);
     try {
         export_pin(pin);
     } catch (const std::exception& e) {
@@ -83,22 +84,73 @@ void setup(int channel, int direction, int initial = -1, int pull_up_down = -1)
         }
     }
     direction(pin, direction);
-    _exports[channel] = direction;
+    _exports.claim(pin, channel, direction);
     if (direction == GPIO.getattr<int>("OUT") && initial != -1) {
+        std::lock_guard<std::mutex> write_lock(_exports.write_lock(pin));
         output(pin, initial);
+        _exports.written(pin, initial ? GPIO.getattr<int>("HIGH") : GPIO.getattr<int>("LOW"));
     }
 }
 
 int input(int channel) {
     _check_configured(channel);  // Can read from a pin configured for output
     int pin = get_gpio_pin(_board, _mode, channel);
-    return input(pin);
+    int level = input(pin);
+    telemetry_level(pin, level);
+    return level;
 }
 
 void output(int channel, int state) {
     _check_configured(channel, direction = GPIO.getattr<int>("OUT"));
     int pin = get_gpio_pin(_board, _mode, channel);
-    output(pin, state);
+    int level = state ? GPIO.getattr<int>("HIGH") : GPIO.getattr<int>("LOW");
+    idle_activity();
+    std::lock_guard<std::mutex> lock(_exports.write_lock(pin));
+    if (_exports.suppress_write(pin, level)) {
+        return;  // line already holds this level
+    }
+    output(pin, level);
+    _exports.written(pin, level);
+    telemetry_output(pin, level);
+    record_output(pin, level);
+}
+
+void output_force(int channel, int state) {
+    // Always write to sysfs, bypassing the shadow state
+    _check_configured(channel, direction = GPIO.getattr<int>("OUT"));
+    int pin = get_gpio_pin(_board, _mode, channel);
+    int level = state ? GPIO.getattr<int>("HIGH") : GPIO.getattr<int>("LOW");
+    idle_activity();
+    std::lock_guard<std::mutex> lock(_exports.write_lock(pin));
+    output(pin, level);
+    _exports.written(pin, level);
+    telemetry_output(pin, level);
+    record_output(pin, level);
+}
+
+int read_back(int channel) {
+    // Level of an output as last written by this process, without touching sysfs
+    _check_configured(channel, direction = GPIO.getattr<int>("OUT"));
+    int pin = get_gpio_pin(_board, _mode, channel);
+    int level = _exports.level(pin);
+    if (level == -1) {  // nothing written yet, ask the kernel once
+        std::lock_guard<std::mutex> lock(_exports.write_lock(pin));
+        level = _exports.level(pin);
+        if (level == -1) {
+            level = input(pin);
+            _exports.written(pin, level);
+        }
+    }
+    return level;
+}
+
+void set_output_resync(unsigned every) {
+    // 0 disables resync, otherwise every n-th suppressed write is sent anyway
+    _exports.set_resync(every);
+}
+
+unsigned long suppressed_writes() {
+    return _exports.suppressed();
 }
 
 int wait_for_edge(int channel, int trigger, int timeout = -1) {
@@ -135,18 +187,27 @@ bool event_detected(int channel) {
     return edge_detected(pin);
 }
 
+static void _cleanup_pin(int pin) {
+    // Caller holds the pin's registry lock
+    remove_edge_detect(pin);
+    unexport_pin(pin);
+    _exports.release(pin);
+}
+
 void cleanup(int channel = -1) {
     if (channel == -1) {
-        for (auto& it : _exports) {
-            cleanup(it.first);
+        for (int pin : _exports.pins()) {  // snapshot; work on lines, another thread may release one meanwhile
+            std::lock_guard<std::mutex> lock(_exports.lock(pin));
+            if (_exports.configured(pin)) {
+                _cleanup_pin(pin);
+            }
         }
         setwarnings(true);
         _mode = -1;
     } else {
-        _check_configured(channel);
         int pin = get_gpio_pin(_board, _mode, channel);
-        cleanup(pin);
-        unexport_pin(pin);
-        _exports.erase(channel);
+        std::lock_guard<std::mutex> lock(_exports.lock(pin));
+        _check_configured(channel);
+        _cleanup_pin(pin);
     }
 }
@@ -8,12 +8,12 @@
 #include "constants.hpp"
 #include "sysfs.hpp"
 #include "event.hpp"
+#include "registry.hpp"
 
 extern bool _gpio_warnings;
 extern int _mode;
 extern int _board;
-extern std::map<int, int> _exports;
-extern std::vector<int> _boards;
+extern _pin_registry _exports;
 extern std::string RPI_INFO;
 
 void _check_configured(int channel, int direction = -1);
@@ -26,6 +26,10 @@ void setwarnings(bool enabled);
 void setup(int channel, int direction, int initial = -1, int pull_up_down = -1);
 int input(int channel);
 void output(int channel, int state);
+void output_force(int channel, int state);
+int read_back(int channel);
+void set_output_resync(unsigned every);
+unsigned long suppressed_writes();
 int wait_for_edge(int channel, int trigger, int timeout = -1);
 void add_event_detect(int channel, int trigger, std::function<void(int)> callback = nullptr, int bouncetime = -1);
 void remove_event_detect(int channel);
@@ -0,0 +1,448 @@
+#include "gpiod.hpp"
+#include "clock.hpp"
+#include "constants.hpp"
+#include "sysfs.hpp"
+#include "event.hpp"
+#include <new>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <linux/futex.h>
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared-memory rings need lock-free 64-bit atomics");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "futex words must be lock-free");
+
+static void _futex_wake(std::atomic<uint32_t>* word) {
+    // Shared (not FUTEX_PRIVATE) futex, the word lives in memory mapped by several processes
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+static void _futex_wait(std::atomic<uint32_t>* word, uint32_t expected, int timeout_ms) {
+    struct timespec ts;
+    struct timespec* timeout = nullptr;
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        timeout = &ts;
+    }
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, timeout, nullptr, 0);
+}
+
+static _gpiod_shm* _map_shm(int fd) {
+    void* addr = mmap(nullptr, sizeof(_gpiod_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "mmap");
+    }
+    return static_cast<_gpiod_shm*>(addr);
+}
+
+static bool _daemon_alive(const _gpiod_shm* shm) {
+    pid_t pid = shm->daemon_pid.load(std::memory_order_acquire);
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+GPIODaemon::GPIODaemon(const std::string& name)
+    : name(name), shm(nullptr), finished(false), handled(0) {
+    int existing = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (existing >= 0) {
+        struct stat st;
+        bool alive = false;
+        if (fstat(existing, &st) == 0 && static_cast<std::size_t>(st.st_size) >= sizeof(_gpiod_shm)) {
+            _gpiod_shm* other = _map_shm(existing);
+            alive = _daemon_alive(other);
+            munmap(other, sizeof(_gpiod_shm));
+        } else {
+            close(existing);
+        }
+        if (alive) {
+            throw std::runtime_error("gpiod is already running on " + name);
+        }
+        shm_unlink(name.c_str());  // stale segment of a daemon that did not exit cleanly
+    }
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0660);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "shm_open " + name);
+    }
+    if (ftruncate(fd, sizeof(_gpiod_shm)) != 0) {
+        int err = errno;
+        close(fd);
+        shm_unlink(name.c_str());
+        throw std::system_error(err, std::generic_category(), "ftruncate " + name);
+    }
+    shm = new (_map_shm(fd)) _gpiod_shm;
+
+    for (int pin = 0; pin < MAX_GPIO_LINES; pin++) {
+        shm->pins[pin].direction.store(-1);
+        shm->pins[pin].level.store(-1);
+        shm->pins[pin].edges.store(0);
+        shm->pins[pin].owner.store(0);
+    }
+    shm->request_tail.store(0);
+    shm->request_head.store(0);
+    shm->request_futex.store(0);
+    for (int i = 0; i < GPIOD_REQUEST_RING; i++) {
+        shm->requests[i].seq.store(i);
+    }
+    shm->result_futex.store(0);
+    for (int i = 0; i < GPIOD_REQUEST_RING; i++) {
+        shm->results[i].seq.store(0);
+    }
+    shm->event_head.store(0);
+    shm->event_futex.store(0);
+    for (int i = 0; i < GPIOD_EVENT_RING; i++) {
+        shm->events[i].seq.store(0);
+    }
+    shm->magic = GPIOD_MAGIC;
+    shm->version = GPIOD_VERSION;
+    shm->daemon_pid.store(getpid(), std::memory_order_release);
+}
+
+GPIODaemon::~GPIODaemon() {
+    stop();
+    for (int pin = 0; pin < MAX_GPIO_LINES; pin++) {
+        if (shm->pins[pin].direction.load() != -1) {
+            remove_edge_detect(pin);
+            unexport_pin(pin);
+        }
+    }
+    shm->daemon_pid.store(0);
+    munmap(shm, sizeof(_gpiod_shm));
+    shm_unlink(name.c_str());
+}
+
+void GPIODaemon::start() {
+    finished = false;
+    thread = std::thread(&GPIODaemon::run, this);
+}
+
+void GPIODaemon::stop() {
+    finished = true;
+    shm->request_futex.fetch_add(1);
+    _futex_wake(&shm->request_futex);
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+unsigned long GPIODaemon::requests_handled() const {
+    return handled.load(std::memory_order_relaxed);
+}
+
+void GPIODaemon::run() {
+    // Single consumer of the request ring
+    while (!finished) {
+        uint32_t futex = shm->request_futex.load(std::memory_order_acquire);
+        uint64_t head = shm->request_head.load(std::memory_order_relaxed);
+        _gpiod_request& slot = shm->requests[head % GPIOD_REQUEST_RING];
+
+        if (slot.seq.load(std::memory_order_acquire) != head + 1) {
+            _futex_wait(&shm->request_futex, futex, -1);
+            continue;
+        }
+
+        _gpiod_request request;
+        request.op = slot.op;
+        request.pin = slot.pin;
+        request.value = slot.value;
+        request.client = slot.client;
+        slot.seq.store(head + GPIOD_REQUEST_RING, std::memory_order_release);
+        shm->request_head.store(head + 1, std::memory_order_relaxed);
+
+        try {
+            handle(request);
+            complete(head, 0, "");
+        } catch (const std::system_error& e) {
+            std::cerr << "gpiod: request " << request.op << " on line " << request.pin << " from " << request.client << " failed: " << e.what() << std::endl;
+            complete(head, e.code().value() ? e.code().value() : EIO, e.what());
+        } catch (const std::exception& e) {
+            std::cerr << "gpiod: request " << request.op << " on line " << request.pin << " from " << request.client << " failed: " << e.what() << std::endl;
+            complete(head, EINVAL, e.what());
+        }
+        handled.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void GPIODaemon::handle(const _gpiod_request& request) {
+    if (request.pin < 0 || request.pin >= MAX_GPIO_LINES) {
+        throw std::out_of_range("GPIO line " + std::to_string(request.pin) + " is out of range");
+    }
+    _gpiod_pin& pin = shm->pins[request.pin];
+    int current = pin.direction.load(std::memory_order_relaxed);
+
+    switch (static_cast<GPIODOp>(request.op)) {
+        case GPIODOp::SETUP_INPUT:
+        case GPIODOp::SETUP_OUTPUT: {
+            int dir = (static_cast<GPIODOp>(request.op) == GPIODOp::SETUP_INPUT) ? GPIO.getattr<int>("IN") : GPIO.getattr<int>("OUT");
+            if (current == dir) {
+                break;  // another client already set the line up the same way, keep its state
+            }
+            int owner = pin.owner.load(std::memory_order_relaxed);
+            if (current != -1 && owner != request.client) {
+                std::string descr = (current == GPIO.getattr<int>("IN")) ? "input" : "output";
+                throw std::runtime_error("Line " + std::to_string(request.pin) + " is configured for " + descr + " by process " + std::to_string(owner));
+            }
+            if (current == -1) {
+                export_pin(request.pin);
+            } else {
+                remove_edge_detect(request.pin);
+            }
+            direction(request.pin, dir);
+            pin.owner.store(request.client, std::memory_order_relaxed);
+            pin.direction.store(dir, std::memory_order_release);
+            if (dir == GPIO.getattr<int>("IN")) {
+                pin.level.store(input(request.pin), std::memory_order_release);
+                add_edge_detect(request.pin, GPIO.getattr<int>("BOTH"), [this](int line) {
+                    publish(line, input(line));
+                });
+            } else if (request.value != -1) {
+                output(request.pin, request.value ? 1 : 0);
+                pin.level.store(request.value ? 1 : 0, std::memory_order_release);
+            }
+            break;
+        }
+        case GPIODOp::OUTPUT: {
+            if (current != GPIO.getattr<int>("OUT")) {
+                throw std::runtime_error("Line " + std::to_string(request.pin) + " is not configured for output");
+            }
+            int level = request.value ? 1 : 0;
+            if (pin.level.load(std::memory_order_relaxed) != level) {  // same redundant-write rule as output()
+                output(request.pin, level);
+                pin.level.store(level, std::memory_order_release);
+            }
+            break;
+        }
+        case GPIODOp::RELEASE: {
+            if (current != -1) {
+                remove_edge_detect(request.pin);
+                unexport_pin(request.pin);
+                pin.direction.store(-1, std::memory_order_release);
+                pin.level.store(-1, std::memory_order_release);
+                pin.owner.store(0, std::memory_order_relaxed);
+            }
+            break;
+        }
+        default:
+            throw std::invalid_argument("Unknown request " + std::to_string(request.op));
+    }
+}
+
+void GPIODaemon::complete(uint64_t position, int error, const char* message) {
+    // Same odd/even protocol as the event ring: a client that was too slow to
+    // read its result sees a later sequence number instead of a torn message
+    _gpiod_result& slot = shm->results[position % GPIOD_REQUEST_RING];
+    slot.seq.store(2 * position + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.error = error;
+    std::strncpy(slot.message, message, sizeof(slot.message) - 1);
+    slot.message[sizeof(slot.message) - 1] = '\0';
+    slot.seq.store(2 * position + 2, std::memory_order_release);
+
+    shm->result_futex.fetch_add(1, std::memory_order_release);
+    _futex_wake(&shm->result_futex);
+}
+
+void GPIODaemon::publish(int pin, int level) {
+    // Only called from edge worker threads; events are serialized by the pin's
+    // worker, but several pins may publish at once, so positions are claimed atomically
+    shm->pins[pin].level.store(level, std::memory_order_release);
+    shm->pins[pin].edges.fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t position = shm->event_head.fetch_add(1, std::memory_order_acq_rel);
+    _gpiod_event_slot& slot = shm->events[position % GPIOD_EVENT_RING];
+    slot.seq.store(2 * position + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.event.timestamp_ns = static_cast<uint64_t>(monotonic_ns());
+    slot.event.pin = pin;
+    slot.event.level = level;
+    slot.seq.store(2 * position + 2, std::memory_order_release);
+
+    shm->event_futex.fetch_add(1, std::memory_order_release);
+    _futex_wake(&shm->event_futex);
+}
+
+GPIOClient::GPIOClient(const std::string& name)
+    : shm(nullptr), cursor(0), lost(0) {
+    int fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "shm_open " + name + " (is the daemon running?)");
+    }
+    shm = _map_shm(fd);
+    if (shm->magic != GPIOD_MAGIC || shm->version != GPIOD_VERSION) {
+        munmap(shm, sizeof(_gpiod_shm));
+        throw std::runtime_error("Incompatible gpiod segment " + name);
+    }
+    if (!_daemon_alive(shm)) {
+        munmap(shm, sizeof(_gpiod_shm));
+        throw std::runtime_error("gpiod is not running on " + name);
+    }
+    cursor = shm->event_head.load(std::memory_order_acquire);  // only new events
+}
+
+GPIOClient::~GPIOClient() {
+    munmap(shm, sizeof(_gpiod_shm));
+}
+
+void GPIOClient::request(GPIODOp op, int pin, int value) {
+    // Multi-producer enqueue, each slot carries its own sequence number
+    uint64_t position = shm->request_tail.load(std::memory_order_relaxed);
+    _gpiod_request* slot;
+    int64_t deadline = 0;
+    while (true) {
+        slot = &shm->requests[position % GPIOD_REQUEST_RING];
+        int64_t diff = static_cast<int64_t>(slot->seq.load(std::memory_order_acquire)) - static_cast<int64_t>(position);
+        if (diff == 0) {
+            if (shm->request_tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {  // ring full, the daemon is behind
+            int64_t now = monotonic_ns();
+            if (deadline == 0) {
+                deadline = now + GPIOD_REQUEST_TIMEOUT_MS * 1000000LL;
+            }
+            if (!_daemon_alive(shm)) {
+                throw std::runtime_error("gpiod is not running");
+            }
+            if (now >= deadline) {
+                throw std::runtime_error("gpiod is not responding");
+            }
+            std::this_thread::yield();
+            position = shm->request_tail.load(std::memory_order_relaxed);
+        } else {
+            position = shm->request_tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->op = static_cast<int32_t>(op);
+    slot->pin = pin;
+    slot->value = value;
+    slot->client = getpid();
+    slot->seq.store(position + 1, std::memory_order_release);
+
+    shm->request_futex.fetch_add(1, std::memory_order_release);
+    _futex_wake(&shm->request_futex);
+
+    // Wait for the daemon to carry the request out
+    _gpiod_result& result = shm->results[position % GPIOD_REQUEST_RING];
+    uint64_t expected = 2 * position + 2;
+    deadline = monotonic_ns() + GPIOD_REQUEST_TIMEOUT_MS * 1000000LL;
+    while (true) {
+        uint32_t futex = shm->result_futex.load(std::memory_order_acquire);
+        uint64_t before = result.seq.load(std::memory_order_acquire);
+        if (before == expected) {
+            int error = result.error;
+            char message[sizeof(result.message)];
+            std::memcpy(message, result.message, sizeof(message));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (result.seq.load(std::memory_order_relaxed) == expected) {
+                if (error != 0) {
+                    throw std::runtime_error(std::string("gpiod: ") + message);
+                }
+                return;
+            }
+            before = expected + 1;  // overwritten while reading
+        }
+        if (before > expected) {
+            throw std::runtime_error("gpiod: result of request on line " + std::to_string(pin) + " was overwritten before it was read");
+        }
+        if (!_daemon_alive(shm)) {
+            throw std::runtime_error("gpiod is not running");
+        }
+        int64_t remaining = deadline - monotonic_ns();
+        if (remaining <= 0) {
+            throw std::runtime_error("gpiod is not responding");
+        }
+        _futex_wait(&shm->result_futex, futex, static_cast<int>((remaining + 999999) / 1000000));
+    }
+}
+
+void GPIOClient::setup(int pin, int direction, int initial) {
+    _check_line(pin);
+    assert(direction == GPIO.getattr<int>("IN") || direction == GPIO.getattr<int>("OUT"));
+    request(direction == GPIO.getattr<int>("IN") ? GPIODOp::SETUP_INPUT : GPIODOp::SETUP_OUTPUT, pin, initial);
+}
+
+void GPIOClient::output(int pin, int value) {
+    _check_line(pin);
+    request(GPIODOp::OUTPUT, pin, value ? 1 : 0);
+}
+
+void GPIOClient::release(int pin) {
+    _check_line(pin);
+    request(GPIODOp::RELEASE, pin, 0);
+}
+
+int GPIOClient::input(int pin) const {
+    // Straight from shared memory: inputs are refreshed by the daemon on every edge,
+    // outputs hold the level the daemon last wrote
+    _check_line(pin);
+    return shm->pins[pin].level.load(std::memory_order_acquire);
+}
+
+uint32_t GPIOClient::edge_count(int pin) const {
+    _check_line(pin);
+    return shm->pins[pin].edges.load(std::memory_order_relaxed);
+}
+
+bool GPIOClient::wait_event(GPIODEvent& event, int timeout_ms) {
+    int64_t deadline = (timeout_ms > 0) ? monotonic_ns() + timeout_ms * 1000000LL : 0;
+    while (true) {
+        uint32_t futex = shm->event_futex.load(std::memory_order_acquire);
+        uint64_t head = shm->event_head.load(std::memory_order_acquire);
+
+        if (head - cursor > static_cast<uint64_t>(GPIOD_EVENT_RING)) {  // we fell behind, skip what was overwritten
+            lost += head - cursor - GPIOD_EVENT_RING;
+            cursor = head - GPIOD_EVENT_RING;
+        }
+
+        if (cursor < head) {
+            _gpiod_event_slot& slot = shm->events[cursor % GPIOD_EVENT_RING];
+            uint64_t expected = 2 * cursor + 2;
+            uint64_t before = slot.seq.load(std::memory_order_acquire);
+            if (before < expected) {
+                if (timeout_ms == 0) {
+                    return false;
+                }
+                std::this_thread::yield();  // position claimed but not written yet
+                continue;
+            }
+            GPIODEvent copy = slot.event;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t after = slot.seq.load(std::memory_order_relaxed);
+            if (before != expected || after != expected) {  // overwritten while reading
+                lost++;
+                cursor++;
+                continue;
+            }
+            event = copy;
+            cursor++;
+            return true;
+        }
+
+        if (timeout_ms == 0) {
+            return false;
+        }
+        int wait_ms = -1;
+        if (timeout_ms > 0) {  // futex wakes can be spurious, wait out the rest of the timeout
+            int64_t remaining = deadline - monotonic_ns();
+            if (remaining <= 0) {
+                return false;
+            }
+            wait_ms = static_cast<int>((remaining + 999999) / 1000000);
+        }
+        _futex_wait(&shm->event_futex, futex, wait_ms);
+    }
+}
+
+unsigned long GPIOClient::events_lost() const {
+    return lost;
+}
@@ -0,0 +1,126 @@
+#ifndef GPIOD_HPP
+#define GPIOD_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include "registry.hpp"
+
+// Single-owner GPIO daemon.
+// One process (the daemon) owns the sysfs lines. Other processes attach to
+// its shared-memory segment, read pin state directly from it, queue output
+// requests and follow the edge event stream. Wakeups go through futexes on
+// words inside the segment, so a request never touches sysfs on the client side.
+// Each request gets a result slot; the client waits for it, so a request the
+// daemon could not carry out fails in the client too.
+
+const uint32_t GPIOD_MAGIC = 0x50545a47;  // "PTZG"
+const uint32_t GPIOD_VERSION = 2;
+const int GPIOD_REQUEST_RING = 256;
+const int GPIOD_EVENT_RING = 1024;
+const int GPIOD_REQUEST_TIMEOUT_MS = 1000;  // a full request ring that does not drain means the daemon is stuck
+
+enum class GPIODOp : int32_t {
+    SETUP_INPUT = 1,   // export as input and follow its edges
+    SETUP_OUTPUT = 2,  // export as output, value is the initial level (-1 to leave it)
+    OUTPUT = 3,
+    RELEASE = 4
+};
+
+struct GPIODEvent {
+    uint64_t timestamp_ns;  // CLOCK_MONOTONIC
+    int32_t pin;            // SoC line
+    int32_t level;
+};
+
+struct _gpiod_pin {
+    std::atomic<int32_t> direction;  // -1 while not set up
+    std::atomic<int32_t> level;
+    std::atomic<uint32_t> edges;
+    std::atomic<int32_t> owner;      // pid of the client that set the direction
+};
+
+struct _gpiod_request {
+    std::atomic<uint64_t> seq;
+    int32_t op;
+    int32_t pin;
+    int32_t value;
+    int32_t client;
+};
+
+struct _gpiod_result {
+    std::atomic<uint64_t> seq;  // 2 * position + 2 once written, odd while being written
+    int32_t error;              // 0 on success
+    char message[124];
+};
+
+struct _gpiod_event_slot {
+    std::atomic<uint64_t> seq;  // 2 * position + 2 once written, odd while being written
+    GPIODEvent event;
+};
+
+struct _gpiod_shm {
+    uint32_t magic;
+    uint32_t version;
+    std::atomic<int32_t> daemon_pid;
+
+    _gpiod_pin pins[MAX_GPIO_LINES];
+
+    alignas(64) std::atomic<uint64_t> request_tail;  // producers (clients)
+    alignas(64) std::atomic<uint64_t> request_head;  // consumer (daemon)
+    alignas(64) std::atomic<uint32_t> request_futex;
+    _gpiod_request requests[GPIOD_REQUEST_RING];
+
+    alignas(64) std::atomic<uint32_t> result_futex;
+    _gpiod_result results[GPIOD_REQUEST_RING];
+
+    alignas(64) std::atomic<uint64_t> event_head;
+    alignas(64) std::atomic<uint32_t> event_futex;
+    _gpiod_event_slot events[GPIOD_EVENT_RING];
+};
+
+class GPIODaemon {
+public:
+    GPIODaemon(const std::string& name = "/ptz-gpiod");
+    ~GPIODaemon();
+
+    void start();
+    void stop();
+    unsigned long requests_handled() const;
+
+private:
+    void run();
+    void handle(const _gpiod_request& request);
+    void publish(int pin, int level);
+    void complete(uint64_t position, int error, const char* message);
+
+    std::string name;
+    _gpiod_shm* shm;
+    std::thread thread;
+    std::atomic<bool> finished;
+    std::atomic<unsigned long> handled;
+};
+
+class GPIOClient {
+public:
+    GPIOClient(const std::string& name = "/ptz-gpiod");
+    ~GPIOClient();
+
+    void setup(int pin, int direction, int initial = -1);
+    void output(int pin, int value);
+    void release(int pin);
+    int input(int pin) const;
+    uint32_t edge_count(int pin) const;
+    bool wait_event(GPIODEvent& event, int timeout_ms = -1);
+    unsigned long events_lost() const;
+
+private:
+    void request(GPIODOp op, int pin, int value);
+
+    _gpiod_shm* shm;
+    uint64_t cursor;
+    unsigned long lost;
+};
+
+#endif // GPIOD_HPP
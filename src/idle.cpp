@@ -0,0 +1,234 @@
+#include "idle.hpp"
+#include "sysfs.hpp"
+#include "clock.hpp"
+#include "registry.hpp"
+#include "telemetry.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+static std::mutex _idle_lock;
+static std::condition_variable _idle_changed;
+static IdleConfig _config;
+static std::thread _monitor;
+static bool _running = false;
+
+static std::atomic<bool> _idle{false};
+static std::atomic<int64_t> _last_activity{0};
+static std::atomic<unsigned long> _wakeups{0};
+
+// Guarded by _idle_lock
+static unsigned long _entries = 0;
+static int64_t _idle_since = 0;
+static int64_t _idle_total = 0;
+static int64_t _last_restore = 0;
+static int64_t _rate_since = 0;
+static unsigned long _rate_wakeups = 0;
+static std::vector<bool> _pwm_was_enabled;     // what _park() found, so _restore() only
+static std::vector<bool> _enable_was_active;   // turns back on what was on
+static unsigned long _errors = 0;
+
+static void _report(const char* step, const char* what, int a, int b, const std::exception& e) {
+    // Parking runs on the monitor thread and restoring inside edge workers and
+    // outputs: a sysfs error there is reported, never thrown
+    _errors++;
+    std::cerr << "Warning: idle " << step << " of " << what << " " << a;
+    if (b >= 0) {
+        std::cerr << "/" << b;
+    }
+    std::cerr << " failed: " << e.what() << std::endl;
+}
+
+static void _set_enable(int pin, int level) {
+    // Through the export registry's shadow too, or a later output() of the
+    // level we overwrote would be suppressed as already written
+    std::lock_guard<std::mutex> lock(_exports.write_lock(pin));
+    output(pin, level);
+    _exports.written(pin, level);
+}
+
+static void _park() {
+    // Caller holds the lock
+    int active = _config.enable_active_high ? 1 : 0;
+    // Only what was actually turned off is marked, so a partial park restores exactly that
+    for (std::size_t i = 0; i < _config.pwm.size(); i++) {
+        const auto& channel = _config.pwm[i];
+        _pwm_was_enabled[i] = false;
+        try {
+            if (PWM_Get_Enabled(channel.first, channel.second)) {
+                PWM_Disable(channel.first, channel.second);
+                telemetry_pwm_enabled(channel.first, channel.second, false);
+                _pwm_was_enabled[i] = true;
+            }
+        } catch (const std::exception& e) {
+            _report("park", "PWM", channel.first, channel.second, e);
+        }
+    }
+    for (std::size_t i = 0; i < _config.enable_pins.size(); i++) {
+        int pin = _config.enable_pins[i];
+        _enable_was_active[i] = false;
+        try {
+            if (input(pin) == active) {
+                _set_enable(pin, 1 - active);
+                _enable_was_active[i] = true;
+            }
+        } catch (const std::exception& e) {
+            _report("park", "enable line", pin, -1, e);
+        }
+    }
+    _idle_since = monotonic_ns();
+    _entries++;
+    _idle.store(true, std::memory_order_release);
+}
+
+static void _restore() {
+    // Caller holds the lock; enables first so the drivers are powered when PWM resumes
+    int64_t start = monotonic_ns();
+    int active = _config.enable_active_high ? 1 : 0;
+    // Every step is tried, and the rig counts as restored even if one fails
+    for (std::size_t i = 0; i < _config.enable_pins.size(); i++) {
+        if (!_enable_was_active[i]) {
+            continue;
+        }
+        try {
+            _set_enable(_config.enable_pins[i], active);
+        } catch (const std::exception& e) {
+            _report("restore", "enable line", _config.enable_pins[i], -1, e);
+        }
+        _enable_was_active[i] = false;
+    }
+    for (std::size_t i = 0; i < _config.pwm.size(); i++) {
+        if (!_pwm_was_enabled[i]) {
+            continue;
+        }
+        try {
+            PWM_Enable(_config.pwm[i].first, _config.pwm[i].second);
+            telemetry_pwm_enabled(_config.pwm[i].first, _config.pwm[i].second, true);
+        } catch (const std::exception& e) {
+            _report("restore", "PWM", _config.pwm[i].first, _config.pwm[i].second, e);
+        }
+        _pwm_was_enabled[i] = false;
+    }
+    int64_t now = monotonic_ns();
+    _idle_total += now - _idle_since;
+    _last_restore = now - start;
+    _idle.store(false, std::memory_order_release);
+}
+
+static void _monitor_run() {
+    std::unique_lock<std::mutex> lock(_idle_lock);
+    while (_running) {
+        _wakeups.fetch_add(1, std::memory_order_relaxed);
+        if (_idle.load(std::memory_order_relaxed)) {
+            _idle_changed.wait(lock);  // fully blocked until activity or idle_stop()
+            continue;
+        }
+        int64_t quiet = monotonic_ns() - _last_activity.load(std::memory_order_relaxed);
+        if (quiet >= _config.quiet_ns) {
+            _park();
+            continue;
+        }
+        _idle_changed.wait_for(lock, std::chrono::nanoseconds(_config.quiet_ns - quiet));
+    }
+}
+
+void idle_start(const IdleConfig& config) {
+    if (config.quiet_ns <= 0) {
+        throw std::invalid_argument("Idle quiet period must be positive");
+    }
+    std::lock_guard<std::mutex> lock(_idle_lock);
+    if (_running) {
+        throw std::runtime_error("Idle management is already running");
+    }
+    _config = config;
+    _pwm_was_enabled.assign(config.pwm.size(), false);
+    _enable_was_active.assign(config.enable_pins.size(), false);
+    _running = true;
+    _entries = 0;
+    _errors = 0;
+    _idle_total = 0;
+    _last_restore = 0;
+    _wakeups.store(0);
+    _rate_wakeups = 0;
+    _rate_since = monotonic_ns();
+    _last_activity.store(_rate_since);
+    _monitor = std::thread(_monitor_run);
+}
+
+void idle_stop() {
+    {
+        std::lock_guard<std::mutex> lock(_idle_lock);
+        if (!_running) {
+            return;
+        }
+        _running = false;
+        if (_idle.load()) {
+            _restore();
+        }
+    }
+    _idle_changed.notify_all();
+    _monitor.join();
+}
+
+void idle_activity() {
+    _last_activity.store(monotonic_ns(), std::memory_order_relaxed);
+    if (!_idle.load(std::memory_order_acquire)) {
+        return;  // the common case costs one clock read and two atomics
+    }
+    {
+        std::lock_guard<std::mutex> lock(_idle_lock);
+        if (_idle.load(std::memory_order_relaxed)) {
+            _restore();
+        }
+    }
+    _idle_changed.notify_all();
+}
+
+void idle_wakeup() {
+    _wakeups.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool idle_active() {
+    return _idle.load(std::memory_order_relaxed);
+}
+
+bool idle_block(const std::atomic<bool>& cancel) {
+    if (!_idle.load(std::memory_order_acquire)) {
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(_idle_lock);
+    bool blocked = false;
+    while (_idle.load(std::memory_order_relaxed) && !cancel.load()) {
+        blocked = true;
+        _idle_changed.wait(lock);
+    }
+    return blocked;
+}
+
+void idle_notify() {
+    std::lock_guard<std::mutex> lock(_idle_lock);  // a blocker checks its flag under the lock, so it cannot miss this
+    _idle_changed.notify_all();
+}
+
+IdleStats idle_stats() {
+    std::lock_guard<std::mutex> lock(_idle_lock);
+    int64_t now = monotonic_ns();
+    IdleStats result;
+    result.idle = _idle.load();
+    result.wakeups = _wakeups.load(std::memory_order_relaxed);
+    if (now > _rate_since) {
+        result.wakeups_per_second = (result.wakeups - _rate_wakeups) * 1e9 / (now - _rate_since);
+    }
+    _rate_since = now;
+    _rate_wakeups = result.wakeups;
+    result.entries = _entries;
+    result.idle_ns = _idle_total + (result.idle ? now - _idle_since : 0);
+    result.last_restore_ns = _last_restore;
+    result.errors = _errors;
+    return result;
+}
@@ -0,0 +1,46 @@
+#ifndef IDLE_HPP
+#define IDLE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Idle management for battery and solar sites.
+// With no edge or command for `quiet_ns` the rig is parked: the listed PWM
+// channels are disabled, motor enable lines are released (only those that
+// were on are turned back on when restoring), and edge workers
+// switch from their 100 ms poll to fully blocking waits. The first edge or
+// command afterwards restores everything before it is acted on.
+
+struct IdleConfig {
+    int64_t quiet_ns = 30000000000LL;              // 30 s without activity
+    std::vector<std::pair<int, int>> pwm;          // (chip, channel) to park with PWM_Disable
+    std::vector<int> enable_pins;                  // SoC lines of motor driver enables
+    bool enable_active_high = true;
+};
+
+struct IdleStats {
+    bool idle = false;
+    unsigned long wakeups = 0;         // thread wakeups counted since idle_start()
+    double wakeups_per_second = 0;     // since the previous idle_stats() call
+    unsigned long entries = 0;         // times the rig was parked
+    int64_t idle_ns = 0;               // total time spent parked
+    int64_t last_restore_ns = 0;       // how long the last wake-up restore took
+    unsigned long errors = 0;          // park or restore steps that failed, reported on stderr
+};
+
+void idle_start(const IdleConfig& config);
+void idle_stop();  // restores the rig if it is parked
+
+void idle_activity();  // an edge or command: restores if parked, restarts the quiet period
+void idle_wakeup();    // a worker or control thread woke up
+bool idle_active();
+
+// Blocks while the rig is parked, until it is restored or `cancel` is set
+// and idle_notify() called. Returns true if it blocked at all.
+bool idle_block(const std::atomic<bool>& cancel);
+void idle_notify();
+IdleStats idle_stats();
+
+#endif // IDLE_HPP
@@ -0,0 +1,319 @@
+#include "preset.hpp"
+#include "control.hpp"
+#include "clock.hpp"
+#include <cmath>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const int _LIVE_PLAN = -2;
+
+// Trapezoidal profile over `distance` finishing in `duration` seconds
+struct _profile {
+    double distance;
+    double duration;
+    double accel;  // 0 for an instant ramp
+    double peak;
+    double ramp;   // seconds spent accelerating, and again decelerating
+
+    double position(double t) const {
+        if (t <= 0) return 0;
+        if (t >= duration) return distance;
+        if (t < ramp) return 0.5 * accel * t * t;
+        if (t > duration - ramp) return distance - 0.5 * accel * (duration - t) * (duration - t);
+        return 0.5 * accel * ramp * ramp + peak * (t - ramp);
+    }
+
+    double velocity(double t) const {
+        if (t <= 0 || t >= duration) return 0;
+        if (t < ramp) return accel * t;
+        if (t > duration - ramp) return accel * (duration - t);
+        return peak;
+    }
+};
+
+static double _minimum_time(double distance, double speed, double accel) {
+    if (distance == 0) return 0;
+    if (accel <= 0) return distance / speed;
+    if (distance >= speed * speed / accel) return distance / speed + speed / accel;  // reaches cruise speed
+    return 2 * std::sqrt(distance / accel);  // triangular
+}
+
+void plan_move(const float* from, const float* to, const float* speed, const PresetAxisLimits* limits, MovePlan& plan) {
+    double distance[PRESET_AXES];
+    double duration = 0;
+    for (int axis = 0; axis < PRESET_AXES; axis++) {
+        double axis_speed = limits[axis].max_speed * (speed ? speed[axis] : 1.0f);
+        distance[axis] = (axis_speed > 0) ? std::fabs(to[axis] - from[axis]) : 0;  // no speed, no movement
+        if (distance[axis] > 0) {
+            duration = std::max(duration, _minimum_time(distance[axis], axis_speed, limits[axis].max_accel));
+        }
+    }
+
+    // Slow the faster axes down so that all of them arrive together
+    _profile profile[PRESET_AXES];
+    for (int axis = 0; axis < PRESET_AXES; axis++) {
+        _profile& p = profile[axis];
+        p.distance = distance[axis];
+        p.duration = duration;
+        p.accel = limits[axis].max_accel;
+        if (p.distance == 0 || duration == 0) {
+            p.peak = 0;
+            p.ramp = 0;
+        } else if (p.accel <= 0) {
+            p.peak = p.distance / duration;
+            p.ramp = 0;
+        } else {
+            double a = p.accel;
+            double discriminant = std::max(0.0, a * a * duration * duration - 4 * a * p.distance);
+            p.peak = (a * duration - std::sqrt(discriminant)) / 2;
+            p.ramp = p.peak / a;
+        }
+    }
+
+    plan.interval_ns = static_cast<int64_t>(std::llround(duration * 1e9 / (PRESET_PLAN_SAMPLES - 1)));
+    for (int axis = 0; axis < PRESET_AXES; axis++) {
+        plan.from[axis] = from[axis];
+        plan.to[axis] = to[axis];
+    }
+    for (int i = 0; i < PRESET_PLAN_SAMPLES; i++) {
+        double t = duration * i / (PRESET_PLAN_SAMPLES - 1);
+        for (int axis = 0; axis < PRESET_AXES; axis++) {
+            const _profile& p = profile[axis];
+            double sign = (to[axis] < from[axis]) ? -1 : 1;
+            if (p.distance == 0) {
+                plan.position[i][axis] = from[axis];
+                plan.duty[i][axis] = 0;
+                continue;
+            }
+            plan.position[i][axis] = static_cast<float>(from[axis] + sign * p.position(t));
+            plan.duty[i][axis] = static_cast<float>(sign * p.velocity(t) / limits[axis].max_speed);
+        }
+    }
+    for (int axis = 0; axis < PRESET_AXES; axis++) {  // land exactly, whatever the rounding
+        if (distance[axis] > 0) {
+            plan.position[PRESET_PLAN_SAMPLES - 1][axis] = to[axis];
+        }
+    }
+}
+
+void follow_plan(const MovePlan& plan, ControlLoop* const* loops) {
+    int64_t start = monotonic_ns();
+    for (int i = 0; i < PRESET_PLAN_SAMPLES; i++) {
+        if (i > 0) {
+            sleep_until_ns(start + i * plan.interval_ns);
+        }
+        for (int axis = 0; axis < PRESET_AXES; axis++) {
+            if (loops[axis]) {
+                loops[axis]->set_target(plan.position[i][axis], plan.duty[i][axis]);
+            }
+        }
+        if (plan.interval_ns == 0) {
+            break;  // nothing moves, the first sample is already the target
+        }
+    }
+}
+
+PresetStore::PresetStore(const std::string& path) : file(nullptr) {
+    int fd = open(path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), "fstat " + path);
+    }
+    bool fresh = (st.st_size == 0);
+    if (!fresh && static_cast<std::size_t>(st.st_size) != sizeof(_preset_file)) {
+        close(fd);
+        throw std::runtime_error(path + " is not a compatible preset file");
+    }
+    if (fresh && ftruncate(fd, sizeof(_preset_file)) != 0) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), "ftruncate " + path);
+    }
+    void* addr = mmap(nullptr, sizeof(_preset_file), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "mmap " + path);
+    }
+    file = static_cast<_preset_file*>(addr);
+
+    if (fresh) {  // zero-filled: no presets, home at the origin, axes without limits
+        file->magic = PRESET_MAGIC;
+        file->version = PRESET_VERSION;
+        file->size = sizeof(_preset_file);
+        sync();
+    } else if (file->magic != PRESET_MAGIC || file->version != PRESET_VERSION || file->size != sizeof(_preset_file)) {
+        munmap(file, sizeof(_preset_file));
+        throw std::runtime_error(path + " is not a compatible preset file");
+    }
+}
+
+PresetStore::~PresetStore() {
+    sync();
+    munmap(file, sizeof(_preset_file));
+}
+
+void PresetStore::check_index(int index) {
+    if (index < 0 || index >= PRESET_SLOTS) {
+        throw std::out_of_range("Preset " + std::to_string(index) + " is out of range");
+    }
+}
+
+void PresetStore::sync() {
+    msync(file, sizeof(_preset_file), MS_SYNC);
+}
+
+void PresetStore::set_limits(int axis, const PresetAxisLimits& limits) {
+    if (axis < 0 || axis >= PRESET_AXES) {
+        throw std::out_of_range("Axis " + std::to_string(axis) + " is out of range");
+    }
+    if (!(limits.max_speed >= 0 && limits.max_accel >= 0) || std::isinf(limits.max_speed) || std::isinf(limits.max_accel)) {
+        throw std::invalid_argument("Axis limits must be finite and not negative");
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    file->limits[axis] = limits;
+    rebuild();
+    sync();
+}
+
+void PresetStore::set_home(const float* position) {
+    for (int axis = 0; axis < PRESET_AXES; axis++) {
+        if (!std::isfinite(position[axis])) {
+            throw std::invalid_argument("Home position must be finite");
+        }
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    std::copy(position, position + PRESET_AXES, file->home);
+    rebuild();
+    sync();
+}
+
+void PresetStore::save(int index, const std::string& name, const float* target, const float* speed) {
+    check_index(index);
+    for (int axis = 0; axis < PRESET_AXES; axis++) {
+        if (!std::isfinite(target[axis])) {
+            throw std::invalid_argument("Preset target must be finite");
+        }
+        if (speed && !(speed[axis] > 0 && speed[axis] <= 1)) {  // written to reject NaN too
+            throw std::out_of_range("Preset speed must be in (0, 1]");
+        }
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    PresetRecord& preset = file->presets[index];
+    std::memset(preset.name, 0, sizeof(preset.name));
+    std::strncpy(preset.name, name.c_str(), sizeof(preset.name) - 1);
+    for (int axis = 0; axis < PRESET_AXES; axis++) {
+        preset.target[axis] = target[axis];
+        preset.speed[axis] = speed ? speed[axis] : 1.0f;
+    }
+    preset.used = 1;
+    rebuild();  // neighbour sets of other presets may change too
+    sync();
+}
+
+void PresetStore::remove(int index) {
+    check_index(index);
+    std::lock_guard<std::mutex> guard(lock);
+    file->presets[index].used = 0;
+    rebuild();
+    sync();
+}
+
+bool PresetStore::used(int index) {
+    check_index(index);
+    std::lock_guard<std::mutex> guard(lock);
+    return file->presets[index].used != 0;
+}
+
+std::string PresetStore::name(int index) {
+    check_index(index);
+    std::lock_guard<std::mutex> guard(lock);
+    return std::string(file->presets[index].name);
+}
+
+void PresetStore::rebuild() {
+    // Caller holds the lock. Neighbours are ranked by the slowest axis' travel time.
+    const PresetAxisLimits* limits = file->limits;
+    auto travel = [&](const float* a, const float* b) {
+        double longest = 0;
+        for (int axis = 0; axis < PRESET_AXES; axis++) {
+            if (limits[axis].max_speed > 0) {
+                longest = std::max(longest, std::fabs(a[axis] - b[axis]) / static_cast<double>(limits[axis].max_speed));
+            }
+        }
+        return longest;
+    };
+
+    for (int index = 0; index < PRESET_SLOTS; index++) {
+        PresetRecord& preset = file->presets[index];
+        if (!preset.used) {
+            continue;
+        }
+
+        plan_move(file->home, preset.target, preset.speed, limits, preset.plans[0]);
+        preset.plans[0].origin = PRESET_HOME;
+        preset.plans[0].target = index;
+
+        std::pair<double, int> nearest[PRESET_SLOTS];
+        int candidates = 0;
+        for (int other = 0; other < PRESET_SLOTS; other++) {
+            if (other != index && file->presets[other].used) {
+                nearest[candidates++] = std::make_pair(travel(file->presets[other].target, preset.target), other);
+            }
+        }
+        int count = std::min(candidates, PRESET_NEIGHBOURS);
+        std::partial_sort(nearest, nearest + count, nearest + candidates);
+
+        for (int n = 0; n < count; n++) {
+            int other = nearest[n].second;
+            MovePlan& plan = preset.plans[1 + n];
+            plan_move(file->presets[other].target, preset.target, preset.speed, limits, plan);
+            plan.origin = other;
+            plan.target = index;
+        }
+        preset.neighbours = count;
+    }
+}
+
+bool PresetStore::recall(int index, const float* current, MovePlan& plan, float tolerance) {
+    check_index(index);
+    for (int axis = 0; axis < PRESET_AXES; axis++) {
+        if (!std::isfinite(current[axis])) {
+            throw std::invalid_argument("Current position must be finite");
+        }
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    const PresetRecord& preset = file->presets[index];
+    if (!preset.used) {
+        throw std::runtime_error("Preset " + std::to_string(index) + " is not set");
+    }
+
+    for (int n = 0; n <= preset.neighbours; n++) {
+        const MovePlan& stored = preset.plans[n];
+        bool matches = true;
+        for (int axis = 0; axis < PRESET_AXES && matches; axis++) {
+            matches = std::fabs(stored.from[axis] - current[axis]) <= tolerance;
+        }
+        if (matches) {
+            plan = stored;
+            return true;
+        }
+    }
+
+    // Off the precomputed routes, e.g. after a manual move
+    plan_move(current, preset.target, preset.speed, file->limits, plan);
+    plan.origin = _LIVE_PLAN;
+    plan.target = index;
+    return false;
+}
@@ -0,0 +1,99 @@
+#ifndef PRESET_HPP
+#define PRESET_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <string>
+
+class ControlLoop;
+
+// Persistent PTZ preset table.
+// The whole table is one fixed-layout struct in a memory-mapped file, so
+// loading it is an mmap and a header check. Each preset carries ready-made
+// move plans (trapezoidal profiles sampled into setpoint and duty tables)
+// from home and from its nearest neighbouring presets; they are rebuilt when
+// presets, home or axis limits change, never on recall.
+
+const uint32_t PRESET_MAGIC = 0x50545a50;  // "PTZP"
+const uint32_t PRESET_VERSION = 1;
+const int PRESET_AXES = 4;  // pan, tilt, zoom, focus
+const int PRESET_SLOTS = 32;
+const int PRESET_NEIGHBOURS = 4;
+const int PRESET_PLAN_SAMPLES = 64;
+const int PRESET_HOME = -1;  // plan origin for moves from home
+
+struct PresetAxisLimits {
+    float max_speed;  // units per second, 0 leaves the axis where it is
+    float max_accel;  // units per second^2, 0 for no ramp
+};
+
+struct MovePlan {
+    int32_t origin;       // preset index or PRESET_HOME, -2 for a live plan
+    int32_t target;
+    int64_t interval_ns;  // between samples, 0 if nothing moves
+    float from[PRESET_AXES];
+    float to[PRESET_AXES];
+    float position[PRESET_PLAN_SAMPLES][PRESET_AXES];  // setpoints, last sample is the target
+    float duty[PRESET_PLAN_SAMPLES][PRESET_AXES];      // signed fraction of max_speed, for feed-forward
+};
+
+struct PresetRecord {
+    int32_t used;
+    int32_t neighbours;  // plans[1..neighbours] are valid
+    char name[32];
+    float target[PRESET_AXES];
+    float speed[PRESET_AXES];  // fraction of the axis max_speed
+    MovePlan plans[1 + PRESET_NEIGHBOURS];  // [0] starts from home
+};
+
+struct _preset_file {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;  // sizeof(_preset_file) when written, guards against layout changes
+    uint32_t reserved;
+    PresetAxisLimits limits[PRESET_AXES];
+    float home[PRESET_AXES];
+    PresetRecord presets[PRESET_SLOTS];
+};
+
+static_assert(sizeof(MovePlan) == 2096, "plan format is fixed");
+static_assert(sizeof(PresetRecord) == 10552, "preset format is fixed");
+static_assert(offsetof(_preset_file, presets) == 64, "header format is fixed");
+static_assert(sizeof(_preset_file) == 337728, "preset file format is fixed");
+
+// Fills `plan` with a time-synchronised move: every axis starts and stops together
+void plan_move(const float* from, const float* to, const float* speed, const PresetAxisLimits* limits, MovePlan& plan);
+
+// Feeds the plan's setpoints, with its duty table as feed-forward, to one
+// control loop per axis (nullptr to skip an axis), blocking until done
+void follow_plan(const MovePlan& plan, ControlLoop* const* loops);
+
+class PresetStore {
+public:
+    PresetStore(const std::string& path);
+    ~PresetStore();
+    PresetStore(const PresetStore&) = delete;
+    PresetStore& operator=(const PresetStore&) = delete;
+
+    void set_limits(int axis, const PresetAxisLimits& limits);
+    void set_home(const float* position);
+    void save(int index, const std::string& name, const float* target, const float* speed = nullptr);  // targets must be finite
+    void remove(int index);
+    bool used(int index);
+    std::string name(int index);
+
+    // Copies the stored plan whose origin is within `tolerance` of `current` on every axis.
+    // Returns false if none matched and the plan had to be computed now.
+    bool recall(int index, const float* current, MovePlan& plan, float tolerance = 0.01f);
+
+private:
+    void check_index(int index);
+    void rebuild();
+    void sync();
+
+    std::mutex lock;
+    _preset_file* file;
+};
+
+#endif // PRESET_HPP
@@ -0,0 +1,407 @@
+#include "protocol.hpp"
+#include "boards.hpp"
+#include "clock.hpp"
+#include "idle.hpp"
+#include <algorithm>
+#include <limits>
+#include <cerrno>
+#include <cstdlib>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+static void _clear(PTZCommand& command, PTZCommandType type, int address) {
+    command.type = type;
+    command.address = address;
+    command.pan = 0;
+    command.tilt = 0;
+    command.zoom = 0;
+    command.focus = 0;
+    command.preset = 0;
+    command.received_ns = static_cast<uint64_t>(monotonic_ns());
+}
+
+// Pelco-D: FF addr cmd1 cmd2 data1 data2 checksum, checksum = sum(addr..data2) mod 256
+PelcoDParser::PelcoDParser() : length(0), decoded(0), rejected(0) {}
+
+bool PelcoDParser::feed(uint8_t byte, PTZCommand& command) {
+    if (length == 0 && byte != 0xFF) {
+        return false;  // waiting for sync
+    }
+    buffer[length++] = byte;
+    if (length < buffer.size()) {
+        return false;
+    }
+
+    uint8_t checksum = static_cast<uint8_t>(buffer[1] + buffer[2] + buffer[3] + buffer[4] + buffer[5]);
+    if (checksum != buffer[6]) {
+        // resync on the next sync byte inside the rejected frame
+        rejected.fetch_add(1, std::memory_order_relaxed);
+        std::size_t next = 1;
+        while (next < buffer.size() && buffer[next] != 0xFF) {
+            next++;
+        }
+        std::copy(buffer.begin() + next, buffer.end(), buffer.begin());
+        length = buffer.size() - next;
+        return false;
+    }
+    length = 0;
+
+    uint8_t address = buffer[1];
+    uint8_t cmd1 = buffer[2];
+    uint8_t cmd2 = buffer[3];
+    uint8_t data1 = buffer[4];
+    uint8_t data2 = buffer[5];
+
+    if (cmd2 & 0x01) {  // extended command
+        switch (cmd2) {
+            case 0x03: _clear(command, PTZCommandType::PRESET_SET, address); break;
+            case 0x05: _clear(command, PTZCommandType::PRESET_CLEAR, address); break;
+            case 0x07: _clear(command, PTZCommandType::PRESET_GOTO, address); break;
+            default: rejected.fetch_add(1, std::memory_order_relaxed); return false;
+        }
+        command.preset = data2;
+        decoded.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    _clear(command, PTZCommandType::MOVE, address);
+    double pan_speed = (data1 == 0xFF) ? 1.0 : std::min<int>(data1, 0x3F) / 63.0;  // 0xFF is "turbo"
+    double tilt_speed = std::min<int>(data2, 0x3F) / 63.0;
+    if (cmd2 & 0x02) command.pan = pan_speed;
+    if (cmd2 & 0x04) command.pan = -pan_speed;
+    if (cmd2 & 0x08) command.tilt = tilt_speed;
+    if (cmd2 & 0x10) command.tilt = -tilt_speed;
+    if (cmd2 & 0x20) command.zoom = 1;
+    if (cmd2 & 0x40) command.zoom = -1;
+    if (cmd2 & 0x80) command.focus = 1;
+    if (cmd1 & 0x01) command.focus = -1;
+    decoded.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+unsigned long PelcoDParser::frames() const {
+    return decoded.load(std::memory_order_relaxed);
+}
+
+unsigned long PelcoDParser::errors() const {
+    return rejected.load(std::memory_order_relaxed);
+}
+
+// VISCA: 8x .. FF, at most 16 bytes
+VISCAParser::VISCAParser() : length(0), decoded(0), rejected(0) {
+    for (int address = 0; address <= VISCA_ADDRESSES; address++) {
+        _clear(states[address], PTZCommandType::MOVE, address);
+    }
+}
+
+bool VISCAParser::feed(uint8_t byte, PTZCommand& command) {
+    if (length == 0 && (byte & 0xF0) != 0x80) {
+        return false;  // waiting for a header byte
+    }
+    buffer[length++] = byte;
+    if (byte == 0xFF) {
+        bool ok = decode(command);
+        length = 0;
+        if (ok) {
+            decoded.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            rejected.fetch_add(1, std::memory_order_relaxed);
+        }
+        return ok;
+    }
+    if (length == buffer.size()) {  // no terminator
+        rejected.fetch_add(1, std::memory_order_relaxed);
+        length = 0;
+    }
+    return false;
+}
+
+static double _visca_variable(uint8_t value, double standard) {
+    // 0x2p / 0x3p carry a speed p of 0..7, plain 0x02 / 0x03 use the standard speed
+    if (value == 0x02 || value == 0x03) {
+        return standard;
+    }
+    return ((value & 0x0F) + 1) / 8.0;
+}
+
+bool VISCAParser::decode(PTZCommand& command) {
+    // VISCA commands change a single axis, the parser keeps the others so
+    // every MOVE it emits carries the full motion state of that camera
+    int address = buffer[0] & 0x0F;
+    if (length < 4 || buffer[1] != 0x01) {
+        return false;  // inquiries and replies are not commands
+    }
+    if (address < 1 || address > VISCA_ADDRESSES) {
+        return false;  // broadcasts carry no motion commands
+    }
+    PTZCommand& state = states[address];
+
+    if (length == 9 && buffer[2] == 0x06 && buffer[3] == 0x01) {  // Pan-tiltDrive
+        double pan_speed = std::min<int>(buffer[4], 0x18) / 24.0;
+        double tilt_speed = std::min<int>(buffer[5], 0x17) / 23.0;
+        state.pan = (buffer[6] == 0x01) ? -pan_speed : (buffer[6] == 0x02) ? pan_speed : 0;
+        state.tilt = (buffer[7] == 0x01) ? tilt_speed : (buffer[7] == 0x02) ? -tilt_speed : 0;
+    } else if (length == 5 && buffer[2] == 0x06 && buffer[3] == 0x04) {  // Pan-tiltDrive Home
+        _clear(command, PTZCommandType::HOME, address);
+        state.pan = 0;
+        state.tilt = 0;
+        return true;
+    } else if (length == 6 && buffer[2] == 0x04 && (buffer[3] == 0x07 || buffer[3] == 0x08)) {  // Zoom / Focus
+        uint8_t value = buffer[4];
+        double speed = 0;
+        if (value == 0x02 || (value & 0xF0) == 0x20) {
+            speed = _visca_variable(value, 0.5);
+        } else if (value == 0x03 || (value & 0xF0) == 0x30) {
+            speed = -_visca_variable(value, 0.5);
+        } else if (value != 0x00) {
+            return false;
+        }
+        if (buffer[3] == 0x07) {
+            state.zoom = speed;
+        } else {
+            state.focus = speed;  // 02 far, 03 near
+        }
+    } else if (length == 7 && buffer[2] == 0x04 && buffer[3] == 0x3F) {  // Memory
+        switch (buffer[4]) {
+            case 0x00: _clear(command, PTZCommandType::PRESET_CLEAR, address); break;
+            case 0x01: _clear(command, PTZCommandType::PRESET_SET, address); break;
+            case 0x02: _clear(command, PTZCommandType::PRESET_GOTO, address); break;
+            default: return false;
+        }
+        command.preset = buffer[5];
+        return true;
+    } else {
+        return false;
+    }
+
+    state.received_ns = static_cast<uint64_t>(monotonic_ns());
+    command = state;
+    return true;
+}
+
+unsigned long VISCAParser::frames() const {
+    return decoded.load(std::memory_order_relaxed);
+}
+
+unsigned long VISCAParser::errors() const {
+    return rejected.load(std::memory_order_relaxed);
+}
+
+CommandQueue::CommandQueue() : head(0), count(0), merged(0), overflow(0) {}
+
+bool CommandQueue::push(const PTZCommand& command) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (count > 0 && command.type == PTZCommandType::MOVE) {
+        // A speed command supersedes a queued speed command for the same camera
+        // that the motion layer has not picked up yet
+        PTZCommand& last = commands[(head + count - 1) % commands.size()];
+        if (last.type == PTZCommandType::MOVE && last.address == command.address) {
+            uint64_t received = last.received_ns;  // latency is measured from the oldest merged frame
+            last = command;
+            last.received_ns = received;
+            merged.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    if (count == commands.size()) {
+        overflow.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    commands[(head + count) % commands.size()] = command;
+    count++;
+    return true;
+}
+
+bool CommandQueue::pop(PTZCommand& command) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (count == 0) {
+        return false;
+    }
+    command = commands[head];
+    head = (head + 1) % commands.size();
+    count--;
+    return true;
+}
+
+unsigned long CommandQueue::coalesced() const {
+    return merged.load(std::memory_order_relaxed);
+}
+
+unsigned long CommandQueue::dropped() const {
+    return overflow.load(std::memory_order_relaxed);
+}
+
+static speed_t _baud(int baud) {
+    switch (baud) {
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+    }
+    throw std::invalid_argument("Unsupported baud rate " + std::to_string(baud));
+}
+
+SerialFrontend::SerialFrontend(const std::string& device, int baud, PTZProtocol protocol)
+    : fd(-1), protocol(protocol), finished(false), bytes(0),
+      dispatched(0), completed(0), latency_min(std::numeric_limits<uint64_t>::max()), latency_max(0), latency_total(0) {
+    if (device.empty()) {
+        return;  // no port, bytes are supplied through feed()
+    }
+    fd = open(device.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + device);
+    }
+    struct termios tty;
+    if (tcgetattr(fd, &tty) != 0) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), "tcgetattr " + device);
+    }
+    cfmakeraw(&tty);
+    cfsetispeed(&tty, _baud(baud));
+    cfsetospeed(&tty, _baud(baud));
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSANOW, &tty) != 0) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), "tcsetattr " + device);
+    }
+}
+
+SerialFrontend::~SerialFrontend() {
+    stop();
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void SerialFrontend::start() {
+    if (fd < 0) {
+        throw std::runtime_error("Serial front-end has no device to read from");
+    }
+    finished = false;
+    thread = std::thread(&SerialFrontend::run, this);
+}
+
+void SerialFrontend::stop() {
+    finished = true;
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void SerialFrontend::run() {
+    uint8_t buffer[256];
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (!finished) {
+        int n = poll(&pfd, 1, 100);
+        if (n <= 0) {
+            continue;
+        }
+        ssize_t size = read(fd, buffer, sizeof(buffer));
+        if (size > 0) {
+            feed(buffer, size);
+        }
+    }
+}
+
+std::size_t SerialFrontend::feed(const uint8_t* data, std::size_t size) {
+    // Parse raw bytes and queue the decoded commands, returns how many were decoded
+    std::size_t decoded = 0;
+    PTZCommand command;
+    for (std::size_t i = 0; i < size; i++) {
+        bool ok = (protocol == PTZProtocol::PELCO_D) ? pelco.feed(data[i], command) : visca.feed(data[i], command);
+        if (ok) {
+            queue.push(command);
+            decoded++;
+        }
+    }
+    bytes.fetch_add(size, std::memory_order_relaxed);
+    return decoded;
+}
+
+bool SerialFrontend::next(PTZCommand& command) {
+    // Called by the motion layer
+    if (!queue.pop(command)) {
+        return false;
+    }
+    idle_activity();  // restore a parked rig before the command is acted on
+    dispatched.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void SerialFrontend::applied(const PTZCommand& command) {
+    // Command-to-output latency, measured once the motion layer has written the outputs
+    uint64_t latency = static_cast<uint64_t>(monotonic_ns()) - command.received_ns;
+    std::lock_guard<std::mutex> lock(latency_lock);
+    completed++;
+    latency_total += latency;
+    latency_min = std::min(latency_min, latency);
+    latency_max = std::max(latency_max, latency);
+}
+
+ProtocolStats SerialFrontend::stats() {
+    ProtocolStats result;
+    result.bytes = bytes.load(std::memory_order_relaxed);
+    result.frames = (protocol == PTZProtocol::PELCO_D) ? pelco.frames() : visca.frames();
+    result.errors = (protocol == PTZProtocol::PELCO_D) ? pelco.errors() : visca.errors();
+    result.coalesced = queue.coalesced();
+    result.dropped = queue.dropped();
+
+    result.dispatched = dispatched.load(std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(latency_lock);
+    result.applied = completed;
+    if (completed > 0) {
+        result.latency_min_ns = latency_min;
+        result.latency_avg_ns = latency_total / completed;
+        result.latency_max_ns = latency_max;
+    }
+    return result;
+}
+
+std::string uart_device(int board, int uart) {
+    // A UART is usable when the board routes both its lines to the header;
+    // the pins must be muxed to the UART by the device tree
+    std::string name = "UART" + std::to_string(uart);
+    try {
+        get_peripheral_pin(board, name + "_TX");
+        get_peripheral_pin(board, name + "_RX");
+    } catch (const std::invalid_argument&) {
+        throw std::invalid_argument(name + " is not routed to the header");
+    }
+    return "/dev/ttyS" + std::to_string(uart);
+}
+
+int open_pty_standin(std::string& slave) {
+    // Pseudo terminal that stands in for a UART: the front-end opens `slave`,
+    // a test or simulator writes frames to the returned master fd
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master < 0) {
+        throw std::system_error(errno, std::generic_category(), "posix_openpt");
+    }
+    if (grantpt(master) != 0 || unlockpt(master) != 0) {
+        int err = errno;
+        close(master);
+        throw std::system_error(err, std::generic_category(), "grantpt/unlockpt");
+    }
+    char name[64];
+    if (ptsname_r(master, name, sizeof(name)) != 0) {
+        int err = errno;
+        close(master);
+        throw std::system_error(err, std::generic_category(), "ptsname_r");
+    }
+    slave = name;
+    return master;
+}
@@ -0,0 +1,140 @@
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Pelco-D / VISCA serial front-end.
+// Parsers are fed one byte at a time from a fixed buffer and never allocate.
+// Decoded commands go through a CommandQueue that folds superseded speed
+// commands together, so the motion layer only sees the latest one.
+
+enum class PTZProtocol {
+    PELCO_D = 0,
+    VISCA = 1
+};
+
+enum class PTZCommandType {
+    MOVE = 0,         // pan/tilt/zoom/focus speeds, all zero means stop
+    HOME = 1,
+    PRESET_SET = 2,
+    PRESET_GOTO = 3,
+    PRESET_CLEAR = 4
+};
+
+struct PTZCommand {
+    PTZCommandType type;
+    int address;
+    double pan;     // -1 (left) .. 1 (right)
+    double tilt;    // -1 (down) .. 1 (up)
+    double zoom;    // -1 (wide) .. 1 (tele)
+    double focus;   // -1 (near) .. 1 (far)
+    int preset;
+    uint64_t received_ns;  // CLOCK_MONOTONIC when the last byte of the frame arrived
+};
+
+class PelcoDParser {
+public:
+    PelcoDParser();
+    bool feed(uint8_t byte, PTZCommand& command);
+    unsigned long frames() const;
+    unsigned long errors() const;
+
+private:
+    std::array<uint8_t, 7> buffer;
+    std::size_t length;
+    std::atomic<unsigned long> decoded;   // written by the reader thread, read by stats()
+    std::atomic<unsigned long> rejected;
+};
+
+const int VISCA_ADDRESSES = 7;  // cameras 1..7 on one daisy chain
+
+class VISCAParser {
+public:
+    VISCAParser();
+    bool feed(uint8_t byte, PTZCommand& command);
+    unsigned long frames() const;
+    unsigned long errors() const;
+
+private:
+    bool decode(PTZCommand& command);
+
+    std::array<uint8_t, 16> buffer;
+    std::size_t length;
+    std::array<PTZCommand, VISCA_ADDRESSES + 1> states;  // last full motion state per address, 0 unused
+    std::atomic<unsigned long> decoded;   // written by the reader thread, read by stats()
+    std::atomic<unsigned long> rejected;
+};
+
+const int COMMAND_QUEUE_SIZE = 64;
+
+class CommandQueue {
+public:
+    CommandQueue();
+    bool push(const PTZCommand& command);
+    bool pop(PTZCommand& command);
+    unsigned long coalesced() const;
+    unsigned long dropped() const;
+
+private:
+    std::mutex lock;
+    std::array<PTZCommand, COMMAND_QUEUE_SIZE> commands;
+    std::size_t head;
+    std::size_t count;
+    std::atomic<unsigned long> merged;
+    std::atomic<unsigned long> overflow;
+};
+
+struct ProtocolStats {
+    unsigned long bytes = 0;
+    unsigned long frames = 0;
+    unsigned long errors = 0;
+    unsigned long coalesced = 0;
+    unsigned long dropped = 0;
+    unsigned long dispatched = 0;  // popped by the motion layer
+    unsigned long applied = 0;     // reported back through applied()
+    uint64_t latency_min_ns = 0;   // frame received -> outputs written (applied())
+    uint64_t latency_avg_ns = 0;
+    uint64_t latency_max_ns = 0;
+};
+
+class SerialFrontend {
+public:
+    SerialFrontend(const std::string& device, int baud, PTZProtocol protocol);
+    ~SerialFrontend();
+
+    void start();
+    void stop();
+    std::size_t feed(const uint8_t* data, std::size_t size);
+    bool next(PTZCommand& command);
+    void applied(const PTZCommand& command);  // call once the command has reached the outputs
+    ProtocolStats stats();
+
+private:
+    void run();
+
+    int fd;
+    PTZProtocol protocol;
+    PelcoDParser pelco;
+    VISCAParser visca;
+    CommandQueue queue;
+    std::thread thread;
+    std::atomic<bool> finished;
+    std::atomic<unsigned long> bytes;
+    std::atomic<unsigned long> dispatched;
+    std::mutex latency_lock;
+    unsigned long completed;
+    uint64_t latency_min;
+    uint64_t latency_max;
+    uint64_t latency_total;
+};
+
+std::string uart_device(int board, int uart);
+int open_pty_standin(std::string& slave);
+
+#endif // PROTOCOL_HPP
@@ -1,9 +1,22 @@
 #include "pwm.hpp"
 #include "sysfs.hpp"
+#include "telemetry.hpp"
+#include "recorder.hpp"
+#include "clock.hpp"
+#include "idle.hpp"
 #include <cmath>
-#include <cstdio>
 #include <cerrno>
-#include <cstring>
+#include <string>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+
+static void _publish_pwm(int chip, int pin, double frequency, double duty_cycle_percent) {
+    int64_t period = static_cast<int64_t>(round((1 / frequency) * 1e9));
+    int64_t duty = static_cast<int64_t>(round(duty_cycle_percent / 100 * period));
+    telemetry_pwm(chip, pin, period, duty);
+    record_pwm(chip, pin, period, duty);
+}
 
 PWM_A::PWM_A(int chip, int pin, double frequency, double duty_cycle_percent, bool invert_polarity)
     : chip(chip), pin(pin), frequency(frequency), duty_cycle_percent(duty_cycle_percent), invert_polarity(invert_polarity) {
@@ -15,6 +28,7 @@ PWM_A::PWM_A(int chip, int pin, double frequency, double duty_cycle_percent, boo
             PWM_Polarity(chip, pin, false);  // don't invert the pwm signal. This is the normal way its used.
         }
         PWM_Enable(chip, pin);
+        telemetry_pwm_enabled(chip, pin, true);
         PWM_Frequency(chip, pin, frequency);
     } catch (const std::system_error& e) {
         if (e.code().value() == EBUSY) {  // Device or resource busy
@@ -29,12 +43,16 @@ PWM_A::PWM_A(int chip, int pin, double frequency, double duty_cycle_percent, boo
 
 void PWM_A::start_pwm() {
     // turn on pwm by setting the duty cycle to what the user specified
+    idle_activity();
     PWM_Duty_Cycle_Percent(chip, pin, duty_cycle_percent);  // duty cycle controls the on-off
+    _publish_pwm(chip, pin, frequency, duty_cycle_percent);
 }
 
 void PWM_A::stop_pwm() {
     // turn on pwm by setting the duty cycle to 0
+    idle_activity();
     PWM_Duty_Cycle_Percent(chip, pin, 0);  // duty cycle at 0 is the equivalent of off
+    _publish_pwm(chip, pin, frequency, 0);
 }
 
 void PWM_A::change_frequency(double new_frequency) {
@@ -45,30 +63,33 @@ void PWM_A::change_frequency(double new_frequency) {
     // 4. If decreasing update the duty cycle period and then the pwm period
     // Why:
     // The sysfs rule for PWM is that PWM Period >= duty cycle period (in nanosecs)
+    idle_activity();
 
     double pwm_period = (1 / new_frequency) * 1e9;
-    int pwm_period_int = static_cast<int>(round(pwm_period));
-    double duty_cycle = (duty_cycle_percent / 100) * pwm_period;
-    int duty_cycle_int = static_cast<int>(round(duty_cycle));
+    int64_t pwm_period_ns = llround(pwm_period);
+    int64_t duty_cycle_ns = llround((duty_cycle_percent / 100) * pwm_period);
 
-    int old_pwm_period = static_cast<int>(round((1 / frequency) * 1e9));
+    int64_t old_pwm_period_ns = llround((1 / frequency) * 1e9);
 
-    if (pwm_period_int > old_pwm_period) {  // if increasing
-        PWM_Period(chip, pin, pwm_period_int);  // update the pwm period
-        PWM_Duty_Cycle(chip, pin, duty_cycle_int);  // update duty cycle
+    if (pwm_period_ns > old_pwm_period_ns) {  // if increasing
+        PWM_Period_ns(chip, pin, pwm_period_ns);  // update the pwm period
+        PWM_Duty_Cycle_ns(chip, pin, duty_cycle_ns);  // update duty cycle
     } else {
-        PWM_Duty_Cycle(chip, pin, duty_cycle_int);  // update duty cycle
-        PWM_Period(chip, pin, pwm_period_int);  // update pwm freq
+        PWM_Duty_Cycle_ns(chip, pin, duty_cycle_ns);  // update duty cycle
+        PWM_Period_ns(chip, pin, pwm_period_ns);  // update pwm freq
     }
 
     frequency = new_frequency;  // update the frequency
+    _publish_pwm(chip, pin, frequency, duty_cycle_percent);
 }
 
 void PWM_A::duty_cycle(double duty_cycle_percent) {
     // in percentage (0-100)
     if (0 <= duty_cycle_percent && duty_cycle_percent <= 100) {
+        idle_activity();
         this->duty_cycle_percent = duty_cycle_percent;
         PWM_Duty_Cycle_Percent(chip, pin, this->duty_cycle_percent);
+        _publish_pwm(chip, pin, frequency, this->duty_cycle_percent);
     } else {
         throw std::out_of_range("Duty cycle must be between 0 and 100. Current value: " + std::to_string(duty_cycle_percent) + " is out of bounds");
     }
@@ -77,11 +98,195 @@ void PWM_A::duty_cycle(double duty_cycle_percent) {
 void PWM_A::pwm_polarity() {
     // invert the polarity of the pwm
     PWM_Disable(chip, pin);
+    telemetry_pwm_enabled(chip, pin, false);
     PWM_Polarity(chip, pin, !invert_polarity);
     PWM_Enable(chip, pin);
+    telemetry_pwm_enabled(chip, pin, true);
 }
 
 void PWM_A::pwm_close() {
     // remove the object from the system
     PWM_Unexport(chip, pin);
 }
+
+static int _open_pwm_attr(int chip, int pin, const char* name) {
+    std::string path = std::string(sysfs_root()) + "/sys/class/pwm/pwmchip" + std::to_string(chip) + "/pwm" + std::to_string(pin) + "/" + name;
+    await_permissions(path);
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    return fd;
+}
+
+static const std::size_t _MAX_GROUP_CHANNELS = 16;
+
+PWMGroup::PWMGroup() : written(0) {}
+
+PWMGroup::~PWMGroup() {
+    for (auto& member : members) {
+        if (member.period_fd >= 0) close(member.period_fd);
+        if (member.duty_fd >= 0) close(member.duty_fd);
+    }
+}
+
+std::size_t PWMGroup::add(PWM_A& channel) {
+    if (members.size() >= _MAX_GROUP_CHANNELS) {
+        throw std::length_error("PWM group is limited to " + std::to_string(_MAX_GROUP_CHANNELS) + " channels");
+    }
+    _member member;
+    member.pwm = &channel;
+    member.frequency = channel.frequency;
+    member.duty_cycle_percent = channel.duty_cycle_percent;
+    member.staged = false;
+    if (sysfs_backend()) {
+        member.period_fd = -1;
+        member.duty_fd = -1;
+        refresh(member);
+        members.push_back(member);
+        return members.size() - 1;
+    }
+    member.period_fd = _open_pwm_attr(channel.chip, channel.pin, "period");
+    try {
+        member.duty_fd = _open_pwm_attr(channel.chip, channel.pin, "duty_cycle");
+    } catch (...) {
+        close(member.period_fd);
+        throw;
+    }
+    try {
+        refresh(member);
+    } catch (...) {
+        close(member.period_fd);
+        close(member.duty_fd);
+        throw;
+    }
+    members.push_back(member);
+    return members.size() - 1;
+}
+
+void PWMGroup::refresh(_member& member) {
+    // Read back what is in sysfs now, whoever wrote it
+    if (SysfsBackend* backend = sysfs_backend()) {
+        member.period = backend->pwm_period(member.pwm->chip, member.pwm->pin);
+        member.duty = backend->pwm_duty_cycle(member.pwm->chip, member.pwm->pin);
+    } else {
+        member.period = sysfs_read_int(member.period_fd);
+        member.duty = sysfs_read_int(member.duty_fd);
+    }
+}
+
+void PWMGroup::stage(std::size_t index, double frequency, double duty_cycle_percent) {
+    if (index >= members.size()) {
+        throw std::out_of_range("PWM group has no channel " + std::to_string(index));
+    }
+    if (duty_cycle_percent > 100) {
+        throw std::out_of_range("Duty cycle must be between 0 and 100. Current value: " + std::to_string(duty_cycle_percent) + " is out of bounds");
+    }
+    _member& member = members[index];
+    if (!member.staged) {  // "keep" means the channel's values now, not when it was added
+        member.frequency = member.pwm->frequency;
+        member.duty_cycle_percent = member.pwm->duty_cycle_percent;
+    }
+    if (frequency > 0) {
+        member.frequency = frequency;
+    }
+    if (duty_cycle_percent >= 0) {
+        member.duty_cycle_percent = duty_cycle_percent;
+    }
+    member.staged = true;
+}
+
+void PWMGroup::set(std::size_t index, double frequency, double duty_cycle_percent) {
+    stage(index, frequency, duty_cycle_percent);
+}
+
+void PWMGroup::set_duty_cycle(std::size_t index, double duty_cycle_percent) {
+    stage(index, -1, duty_cycle_percent);
+}
+
+void PWMGroup::commit(int64_t align_ns) {
+    struct _target {
+        int64_t period;
+        int64_t duty;
+    };
+    _target targets[_MAX_GROUP_CHANNELS];  // add() keeps the group within this
+    idle_activity();
+
+    // Same conversion as change_frequency()
+    for (std::size_t i = 0; i < members.size(); i++) {
+        _member& member = members[i];
+        int64_t period = static_cast<int64_t>(round((1 / member.frequency) * 1e9));
+        targets[i].period = period;
+        targets[i].duty = static_cast<int64_t>(round((member.duty_cycle_percent / 100) * period));
+    }
+
+    if (align_ns > 0) {
+        // Start the batch on a common tick of CLOCK_MONOTONIC; the PWM
+        // controller itself is free running, so this aligns with the
+        // caller's timeline (e.g. the motion loop), not with the PWM period
+        sleep_until_ns((monotonic_ns() / align_ns + 1) * align_ns);
+    }
+
+    for (std::size_t i = 0; i < members.size(); i++) {  // 1. periods that grow
+        _member& member = members[i];
+        if (member.staged && targets[i].period > member.period) {
+            write(member, false, targets[i].period);
+            member.period = targets[i].period;
+            written++;
+        }
+    }
+    for (std::size_t i = 0; i < members.size(); i++) {  // 2. every duty cycle
+        _member& member = members[i];
+        if (member.staged && targets[i].duty != member.duty) {
+            write(member, true, targets[i].duty);
+            member.duty = targets[i].duty;
+            written++;
+        }
+    }
+    for (std::size_t i = 0; i < members.size(); i++) {  // 3. periods that shrink
+        _member& member = members[i];
+        if (member.staged && targets[i].period < member.period) {
+            write(member, false, targets[i].period);
+            member.period = targets[i].period;
+            written++;
+        }
+    }
+
+    for (auto& member : members) {
+        if (member.staged) {
+            member.pwm->frequency = member.frequency;
+            member.pwm->duty_cycle_percent = member.duty_cycle_percent;
+            _publish_pwm(member.pwm->chip, member.pwm->pin, member.frequency, member.duty_cycle_percent);
+            member.staged = false;
+        }
+    }
+}
+
+void PWMGroup::write(_member& member, bool duty, int64_t value) {
+    if (SysfsBackend* backend = sysfs_backend()) {
+        if (duty) {
+            backend->pwm_set_duty_cycle(member.pwm->chip, member.pwm->pin, value);
+        } else {
+            backend->pwm_set_period(member.pwm->chip, member.pwm->pin, value);
+        }
+    } else {
+        sysfs_write_int(duty ? member.duty_fd : member.period_fd, value);
+    }
+}
+
+void PWMGroup::apply(const std::vector<PWMUpdate>& updates, int64_t align_ns) {
+    for (const auto& update : updates) {
+        stage(update.index, update.frequency, update.duty_cycle_percent);
+    }
+    commit(align_ns);
+}
+
+void PWMGroup::resync() {
+    for (auto& member : members) {
+        refresh(member);
+    }
+}
+
+unsigned long PWMGroup::writes() const {
+    return written;
+}
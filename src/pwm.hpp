@@ -2,6 +2,8 @@
 #define PWM_HPP
 
 #include <stdexcept>
+#include <cstdint>
+#include <vector>
 #include "sysfs.hpp"
 
 class PWM_A {
@@ -16,6 +18,8 @@ public:
     void pwm_close();
 
 private:
+    friend class PWMGroup;
+
     int chip;
     int pin;
     double frequency;
@@ -23,4 +27,53 @@ private:
     bool invert_polarity;
 };
 
+struct PWMUpdate {
+    std::size_t index;          // as returned by PWMGroup::add()
+    double frequency;           // <= 0 keeps the current frequency
+    double duty_cycle_percent;  // < 0 keeps the current duty cycle
+};
+
+// Several PWM_A channels updated as one batch (e.g. pan and tilt).
+// Changes are staged and committed together: growing periods first, then all
+// duty cycles back to back, then shrinking periods, so every write respects
+// the period >= duty rule of change_frequency() and the duties of all
+// channels land as close together as sysfs allows. Unchanged values are not
+// written: the group remembers what it last wrote (read once by add()), so
+// call resync() after PWM_A or a control loop wrote one of its channels
+// directly. A group holds at most 16 channels.
+class PWMGroup {
+public:
+    PWMGroup();
+    ~PWMGroup();
+    PWMGroup(const PWMGroup&) = delete;
+    PWMGroup& operator=(const PWMGroup&) = delete;
+
+    std::size_t add(PWM_A& channel);
+    void set(std::size_t index, double frequency, double duty_cycle_percent);
+    void set_duty_cycle(std::size_t index, double duty_cycle_percent);
+    void commit(int64_t align_ns = 0);
+    void apply(const std::vector<PWMUpdate>& updates, int64_t align_ns = 0);
+    void resync();
+    unsigned long writes() const;
+
+private:
+    struct _member {
+        PWM_A* pwm;
+        int period_fd;
+        int duty_fd;
+        int64_t period;  // values in sysfs as of add(), commit() or resync()
+        int64_t duty;
+        double frequency;  // staged values
+        double duty_cycle_percent;
+        bool staged;
+    };
+
+    void stage(std::size_t index, double frequency, double duty_cycle_percent);
+    void refresh(_member& member);
+    void write(_member& member, bool duty, int64_t value);
+
+    std::vector<_member> members;
+    unsigned long written;
+};
+
 #endif // PWM_HPP
@@ -0,0 +1,183 @@
+#include "realtime.hpp"
+#include <array>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <limits>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include <stdexcept>
+#include <iostream>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <time.h>
+
+static std::mutex _realtime_lock;
+static std::array<RealtimeConfig, 2> _realtime_config;
+static bool _memory_locked = false;
+
+void set_realtime(ThreadRole role, const RealtimeConfig& config) {
+    if (config.policy != SCHED_OTHER && config.policy != SCHED_FIFO && config.policy != SCHED_RR) {
+        throw std::invalid_argument("Invalid scheduling policy");
+    }
+    if (config.policy == SCHED_OTHER && config.priority != 0) {
+        throw std::invalid_argument("SCHED_OTHER threads must use priority 0");
+    }
+    if (config.policy != SCHED_OTHER && (config.priority < sched_get_priority_min(config.policy) || config.priority > sched_get_priority_max(config.policy))) {
+        throw std::out_of_range("Priority " + std::to_string(config.priority) + " is out of range for the selected policy");
+    }
+    for (int cpu : config.cpus) {
+        if (cpu < 0 || cpu >= CPU_SETSIZE) {
+            throw std::out_of_range("CPU " + std::to_string(cpu) + " is out of range");
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(_realtime_lock);
+    _realtime_config[static_cast<int>(role)] = config;
+}
+
+RealtimeConfig get_realtime(ThreadRole role) {
+    std::lock_guard<std::mutex> lock(_realtime_lock);
+    return _realtime_config[static_cast<int>(role)];
+}
+
+void apply_realtime(ThreadRole role) {
+    // Called by each internal thread right after it starts, before it enters its loop
+    RealtimeConfig config = get_realtime(role);
+
+    if (!config.cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : config.cpus) {
+            CPU_SET(cpu, &set);
+        }
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            throw std::system_error(err, std::generic_category(), "pthread_setaffinity_np");
+        }
+    }
+
+    struct sched_param param;
+    std::memset(&param, 0, sizeof(param));
+    param.sched_priority = config.priority;
+    int err = pthread_setschedparam(pthread_self(), config.policy, &param);
+    if (err != 0) {
+        throw std::system_error(err, std::generic_category(), "pthread_setschedparam");
+    }
+
+    if (config.prefault_stack > 0) {
+        prefault_stack(config.prefault_stack);
+    }
+}
+
+bool apply_realtime_or_warn(ThreadRole role) {
+    // For threads that must keep running without privileges, e.g. edge workers hitting EPERM
+    try {
+        apply_realtime(role);
+        return true;
+    } catch (const std::system_error& e) {
+        std::cerr << "Warning: real-time scheduling not applied, continuing with normal scheduling: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+void lock_memory() {
+    // Lock everything mapped now and in the future so the edge and motion paths never take a page fault
+    std::lock_guard<std::mutex> lock(_realtime_lock);
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        throw std::system_error(errno, std::generic_category(), "mlockall");
+    }
+    _memory_locked = true;
+}
+
+void unlock_memory() {
+    std::lock_guard<std::mutex> lock(_realtime_lock);
+    if (munlockall() != 0) {
+        throw std::system_error(errno, std::generic_category(), "munlockall");
+    }
+    _memory_locked = false;
+}
+
+bool memory_locked() {
+    std::lock_guard<std::mutex> lock(_realtime_lock);
+    return _memory_locked;
+}
+
+__attribute__((noinline)) void prefault_stack(std::size_t size) {
+    // Touch one byte per page so the stack is already mapped (and locked, after lock_memory()) when it is needed
+    const std::size_t page = 4096;
+
+    // Stay well inside the stack: threads get RLIMIT_STACK (2 MiB if unlimited) and part of it is already in use
+    struct rlimit limit;
+    std::size_t stack_size = 2 * 1024 * 1024;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        stack_size = limit.rlim_cur;
+    }
+    size = std::min(size, stack_size / 4);
+
+    volatile unsigned char* stack = static_cast<volatile unsigned char*>(__builtin_alloca(size));
+    for (std::size_t i = 0; i < size; i += page) {
+        stack[i] = 0;
+    }
+}
+
+static long _timespec_ns(const struct timespec& ts) {
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+JitterReport measure_jitter(ThreadRole role, int interval_us, int loops, long threshold_ns) {
+    // cyclictest-style probe: sleep until an absolute deadline with the role's
+    // scheduling and measure how late the thread actually wakes up
+    if (interval_us <= 0 || loops <= 0) {
+        throw std::invalid_argument("interval_us and loops must be positive");
+    }
+
+    JitterReport report;
+    std::exception_ptr exc;
+
+    std::thread probe([&]() {
+        try {
+            apply_realtime(role);
+
+            long min_ns = std::numeric_limits<long>::max();
+            long max_ns = 0;
+            long long total_ns = 0;
+
+            struct timespec next;
+            clock_gettime(CLOCK_MONOTONIC, &next);
+
+            for (int i = 0; i < loops; i++) {
+                next.tv_nsec += interval_us * 1000L;
+                while (next.tv_nsec >= 1000000000L) {
+                    next.tv_nsec -= 1000000000L;
+                    next.tv_sec++;
+                }
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                long latency = _timespec_ns(now) - _timespec_ns(next);
+
+                if (latency < min_ns) min_ns = latency;
+                if (latency > max_ns) max_ns = latency;
+                if (latency > threshold_ns) report.over_threshold++;
+                total_ns += latency;
+                report.samples++;
+            }
+
+            report.min_ns = min_ns;
+            report.max_ns = max_ns;
+            report.avg_ns = static_cast<long>(total_ns / report.samples);
+        } catch (...) {
+            exc = std::current_exception();
+        }
+    });
+    probe.join();
+
+    if (exc) {
+        std::rethrow_exception(exc);
+    }
+    return report;
+}
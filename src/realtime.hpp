@@ -0,0 +1,41 @@
+#ifndef REALTIME_HPP
+#define REALTIME_HPP
+
+#include <vector>
+#include <cstddef>
+#include <sched.h>
+
+// Internal threads of the library that can be given their own scheduling.
+enum class ThreadRole {
+    EVENT = 0,   // edge reactor threads (event.cpp)
+    MOTION = 1   // motion / control loop threads
+};
+
+struct RealtimeConfig {
+    int policy = SCHED_OTHER;        // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+    int priority = 0;                // 1..99 for SCHED_FIFO / SCHED_RR, 0 for SCHED_OTHER
+    std::vector<int> cpus;           // CPU affinity, empty means "any CPU"
+    std::size_t prefault_stack = 0;  // bytes of stack touched when the thread starts
+};
+
+struct JitterReport {
+    long samples = 0;
+    long min_ns = 0;
+    long avg_ns = 0;
+    long max_ns = 0;
+    long over_threshold = 0;  // samples with latency above the threshold passed to measure_jitter()
+};
+
+void set_realtime(ThreadRole role, const RealtimeConfig& config);
+RealtimeConfig get_realtime(ThreadRole role);
+void apply_realtime(ThreadRole role);
+bool apply_realtime_or_warn(ThreadRole role);  // falls back to the current scheduling on failure
+
+void lock_memory();
+void unlock_memory();
+bool memory_locked();
+void prefault_stack(std::size_t size);
+
+JitterReport measure_jitter(ThreadRole role, int interval_us = 1000, int loops = 10000, long threshold_ns = 100000);
+
+#endif // REALTIME_HPP
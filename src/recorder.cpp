@@ -0,0 +1,203 @@
+#include "recorder.hpp"
+#include "clock.hpp"
+#include "event.hpp"
+#include <mutex>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static std::mutex _recorder_lock;
+static std::atomic<_recorder_header*> _recorder{nullptr};
+static std::size_t _recorder_length = 0;
+static std::atomic<int> _recorder_writers{0};  // appends that may still touch the mapping
+
+static void _append_to(_recorder_header* header, RecordType type, int pin, int64_t a, int64_t b) {
+    uint64_t position = header->head.fetch_add(1, std::memory_order_relaxed);
+    uint64_t now = static_cast<uint64_t>(monotonic_ns());  // after claiming, so ring order follows time closely
+    Record* records = reinterpret_cast<Record*>(header + 1);
+    Record& record = records[position % header->capacity];
+
+    record.type.store(static_cast<uint32_t>(RecordType::NONE), std::memory_order_relaxed);  // may be overwriting an old record
+    std::atomic_thread_fence(std::memory_order_release);
+    record.timestamp_ns = now;
+    record.pin = pin;
+    record.a = a;
+    record.b = b;
+    record.type.store(static_cast<uint32_t>(type), std::memory_order_release);
+}
+
+static void _append(RecordType type, int pin, int64_t a, int64_t b) {
+    // Same scheme as telemetry: a relaxed check keeps the stopped case cheap,
+    // the writer count pins the mapping until recorder_stop() has seen it drop
+    if (!_recorder.load(std::memory_order_relaxed)) {
+        return;
+    }
+    _recorder_writers.fetch_add(1);
+    _recorder_header* header = _recorder.load();
+    if (header) {
+        _append_to(header, type, pin, a, b);
+    }
+    _recorder_writers.fetch_sub(1, std::memory_order_release);
+}
+
+void recorder_start(const std::string& path, std::size_t capacity) {
+    if (capacity == 0) {
+        throw std::invalid_argument("Recorder capacity must be positive");
+    }
+
+    std::lock_guard<std::mutex> lock(_recorder_lock);
+    if (_recorder.load()) {
+        throw std::runtime_error("Recorder is already running");
+    }
+
+    std::size_t length = sizeof(_recorder_header) + capacity * sizeof(Record);
+    int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    if (ftruncate(fd, length) != 0) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), "ftruncate " + path);
+    }
+    void* addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "mmap " + path);
+    }
+
+    // The file is freshly truncated, so every record already reads as NONE
+    _recorder_header* header = static_cast<_recorder_header*>(addr);
+    header->magic = RECORDER_MAGIC;
+    header->version = RECORDER_VERSION;
+    header->record_size = sizeof(Record);
+    header->capacity = capacity;
+    header->head.store(0);
+
+    _recorder_length = length;
+    _recorder.store(header, std::memory_order_release);
+}
+
+void recorder_stop() {
+    // Safe while edge workers and outputs are still running: appends that
+    // already hold the old mapping finish before it is unmapped
+    std::lock_guard<std::mutex> lock(_recorder_lock);
+    _recorder_header* header = _recorder.exchange(nullptr);
+    if (header) {
+        while (_recorder_writers.load(std::memory_order_acquire) != 0) {
+            std::this_thread::yield();
+        }
+        msync(header, _recorder_length, MS_SYNC);
+        munmap(header, _recorder_length);
+    }
+}
+
+bool recorder_active() {
+    return _recorder.load(std::memory_order_relaxed) != nullptr;
+}
+
+void record_edge(int pin, int level) {
+    _append(RecordType::EDGE, pin, level, 0);
+}
+
+void record_output(int pin, int level) {
+    _append(RecordType::OUTPUT, pin, level, 0);
+}
+
+void record_pwm(int chip, int channel, int64_t period_ns, int64_t duty_ns) {
+    _append(RecordType::PWM, (chip << 16) | channel, period_ns, duty_ns);
+}
+
+Replay::Replay(const std::string& path) : header(nullptr), records(nullptr), length(0), first(0), count(0) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), "fstat " + path);
+    }
+    length = st.st_size;
+    if (length < sizeof(_recorder_header)) {
+        close(fd);
+        throw std::runtime_error(path + " is not a recording");
+    }
+    void* addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "mmap " + path);
+    }
+
+    header = static_cast<const _recorder_header*>(addr);
+    if (header->magic != RECORDER_MAGIC || header->version != RECORDER_VERSION || header->record_size != sizeof(Record)
+            || length < sizeof(_recorder_header) + header->capacity * sizeof(Record)) {
+        munmap(addr, length);
+        throw std::runtime_error(path + " is not a compatible recording");
+    }
+    records = reinterpret_cast<const Record*>(header + 1);
+
+    // Once the ring has wrapped only the last `capacity` records survive
+    uint64_t head = header->head.load();
+    first = (head > header->capacity) ? head - header->capacity : 0;
+    count = head - first;
+}
+
+Replay::~Replay() {
+    munmap(const_cast<_recorder_header*>(header), length);
+}
+
+std::size_t Replay::size() const {
+    return count;
+}
+
+const Record& Replay::operator[](std::size_t index) const {
+    if (index >= count) {
+        throw std::out_of_range("Record " + std::to_string(index) + " is out of range");
+    }
+    return records[(first + index) % header->capacity];
+}
+
+void Replay::run(double speed, std::function<void(const Record&)> observer) {
+    if (speed < 0) {
+        throw std::invalid_argument("Replay speed must not be negative");
+    }
+
+    int64_t start_ns = monotonic_ns();
+    uint64_t origin = 0;
+    bool have_origin = false;
+
+    for (std::size_t i = 0; i < count; i++) {
+        const Record& record = (*this)[i];
+        RecordType type = static_cast<RecordType>(record.type.load(std::memory_order_acquire));
+        if (type == RecordType::NONE) {
+            continue;  // the process stopped while this record was being written
+        }
+        if (!have_origin) {
+            origin = record.timestamp_ns;
+            have_origin = true;
+        }
+
+        if (speed > 0) {  // sleep until the record's offset from the first one, scaled
+            // Concurrent writers can still land slightly out of order, never wait for a negative offset
+            int64_t offset = static_cast<int64_t>(record.timestamp_ns - origin);
+            if (offset > 0) {
+                sleep_until_ns(start_ns + static_cast<int64_t>(offset / speed));
+            }
+        }
+
+        if (type == RecordType::EDGE) {
+            inject_edge(record.pin);
+        }
+        if (observer) {
+            observer(record);
+        }
+    }
+}
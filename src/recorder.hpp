@@ -0,0 +1,74 @@
+#ifndef RECORDER_HPP
+#define RECORDER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <string>
+
+// Binary edge/output/PWM recorder.
+// Records go into a memory-mapped file used as a ring: a fixed header followed
+// by `capacity` 32-byte records. Appending is one fetch_add and one record store.
+
+const uint32_t RECORDER_MAGIC = 0x50545a52;  // "PTZR"
+const uint32_t RECORDER_VERSION = 1;
+
+enum class RecordType : uint32_t {
+    NONE = 0,    // slot never written
+    EDGE = 1,    // pin, a = level (-1 if not sampled)
+    OUTPUT = 2,  // pin, a = level
+    PWM = 3      // pin = chip << 16 | channel, a = period ns, b = duty ns
+};
+
+struct Record {
+    uint64_t timestamp_ns;  // CLOCK_MONOTONIC
+    std::atomic<uint32_t> type;  // stored last, a record is complete once it is non-zero
+    int32_t pin;
+    int64_t a;
+    int64_t b;
+};
+
+struct _recorder_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t capacity;
+    std::atomic<uint64_t> head;  // total records ever appended
+    uint8_t padding[32];
+};
+
+static_assert(sizeof(Record) == 32, "record format is fixed");
+static_assert(sizeof(_recorder_header) == 64, "header format is fixed");
+
+void recorder_start(const std::string& path, std::size_t capacity = 1 << 20);
+void recorder_stop();
+bool recorder_active();
+
+void record_edge(int pin, int level = -1);
+void record_output(int pin, int level);
+void record_pwm(int chip, int channel, int64_t period_ns, int64_t duty_ns);
+
+class Replay {
+public:
+    Replay(const std::string& path);
+    ~Replay();
+
+    std::size_t size() const;
+    const Record& operator[](std::size_t index) const;
+
+    // speed 1.0 replays at recorded timing, 0 as fast as possible.
+    // EDGE records go through the add_event_detect callbacks of the pin,
+    // every record is also passed to observer if one is given.
+    void run(double speed = 1.0, std::function<void(const Record&)> observer = nullptr);
+
+private:
+    const _recorder_header* header;
+    const Record* records;
+    std::size_t length;
+    uint64_t first;
+    std::size_t count;
+};
+
+#endif // RECORDER_HPP
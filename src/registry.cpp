@@ -0,0 +1,111 @@
+#include "registry.hpp"
+#include <string>
+#include <stdexcept>
+
+_pin_registry _exports;
+
+void _check_line(int pin) {
+    if (pin < 0 || pin >= MAX_GPIO_LINES) {
+        throw std::out_of_range("GPIO line " + std::to_string(pin) + " is out of range");
+    }
+}
+
+bool _pin_registry::claim(int pin, int channel, int direction) {
+    // Caller must hold lock(pin)
+    _check_line(pin);
+    _pin_slot& slot = _slots[pin];
+    if (slot.direction.load(std::memory_order_acquire) != -1) {
+        return false;
+    }
+    slot.channel.store(channel, std::memory_order_relaxed);
+    slot.level.store(-1, std::memory_order_relaxed);
+    slot.skipped.store(0, std::memory_order_relaxed);
+    slot.direction.store(direction, std::memory_order_release);
+    return true;
+}
+
+void _pin_registry::release(int pin) {
+    // Caller must hold lock(pin)
+    _check_line(pin);
+    _pin_slot& slot = _slots[pin];
+    slot.direction.store(-1, std::memory_order_release);
+    slot.channel.store(-1, std::memory_order_relaxed);
+    slot.level.store(-1, std::memory_order_relaxed);
+}
+
+bool _pin_registry::configured(int pin) const {
+    return direction(pin) != -1;
+}
+
+int _pin_registry::direction(int pin) const {
+    _check_line(pin);
+    return _slots[pin].direction.load(std::memory_order_acquire);
+}
+
+int _pin_registry::channel(int pin) const {
+    _check_line(pin);
+    return _slots[pin].channel.load(std::memory_order_relaxed);
+}
+
+std::vector<int> _pin_registry::pins() const {
+    std::vector<int> result;
+    for (int pin = 0; pin < MAX_GPIO_LINES; pin++) {
+        if (_slots[pin].direction.load(std::memory_order_acquire) != -1) {
+            result.push_back(pin);
+        }
+    }
+    return result;
+}
+
+std::mutex& _pin_registry::lock(int pin) {
+    _check_line(pin);
+    return _shards[pin % REGISTRY_SHARDS];
+}
+
+std::mutex& _pin_registry::write_lock(int pin) {
+    _check_line(pin);
+    return _slots[pin].write_lock;
+}
+
+bool _pin_registry::suppress_write(int pin, int level) {
+    // Caller must hold write_lock(pin)
+    // True when the line already carries this level and the write can be skipped.
+    // Every _resync-th skipped write goes through anyway, in case something
+    // outside the library changed the line behind our back.
+    _check_line(pin);
+    _pin_slot& slot = _slots[pin];
+    if (slot.level.load(std::memory_order_acquire) != level) {
+        return false;
+    }
+    unsigned every = _resync.load(std::memory_order_relaxed);
+    if (every != 0 && slot.skipped.fetch_add(1, std::memory_order_relaxed) + 1 >= every) {
+        return false;
+    }
+    _suppressed.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void _pin_registry::written(int pin, int level) {
+    // Caller must hold write_lock(pin)
+    _check_line(pin);
+    _slots[pin].skipped.store(0, std::memory_order_relaxed);
+    _slots[pin].level.store(level, std::memory_order_release);
+}
+
+int _pin_registry::level(int pin) const {
+    _check_line(pin);
+    return _slots[pin].level.load(std::memory_order_acquire);
+}
+
+void _pin_registry::invalidate(int pin) {
+    _check_line(pin);
+    _slots[pin].level.store(-1, std::memory_order_release);
+}
+
+void _pin_registry::set_resync(unsigned every) {
+    _resync.store(every, std::memory_order_relaxed);
+}
+
+unsigned long _pin_registry::suppressed() const {
+    return _suppressed.load(std::memory_order_relaxed);
+}
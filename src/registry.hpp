@@ -0,0 +1,55 @@
+#ifndef REGISTRY_HPP
+#define REGISTRY_HPP
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// PA..PZ, 32 lines per port (see _sunXi in boards.cpp)
+const int MAX_GPIO_LINES = 26 * 32;
+const int REGISTRY_SHARDS = 16;
+
+struct _pin_slot {
+    std::atomic<int> direction{-1};  // -1 while the line is not exported
+    std::atomic<int> channel{-1};    // channel number the line was set up with
+    std::atomic<int> level{-1};      // last level written to an output, -1 if unknown
+    std::atomic<unsigned> skipped{0};  // writes suppressed since the last real write
+    std::mutex write_lock;           // makes shadow check, sysfs write and shadow update one step
+};
+
+// Exported lines indexed by SoC line number.
+// Lookups on the I/O path are single atomic loads; setup and cleanup of a
+// line are serialized through the shard mutex that owns it. Writers of a
+// line hold its write_lock() from suppress_write() to written(), or two
+// racing writes could leave the shadow at the level that lost.
+class _pin_registry {
+public:
+    bool claim(int pin, int channel, int direction);
+    void release(int pin);
+    bool configured(int pin) const;
+    int direction(int pin) const;
+    int channel(int pin) const;
+    std::vector<int> pins() const;
+    std::mutex& lock(int pin);
+
+    std::mutex& write_lock(int pin);
+    bool suppress_write(int pin, int level);
+    void written(int pin, int level);
+    int level(int pin) const;
+    void invalidate(int pin);
+    void set_resync(unsigned every);
+    unsigned long suppressed() const;
+
+private:
+    std::array<_pin_slot, MAX_GPIO_LINES> _slots;
+    std::atomic<unsigned> _resync{0};
+    std::atomic<unsigned long> _suppressed{0};
+    std::array<std::mutex, REGISTRY_SHARDS> _shards;
+};
+
+extern _pin_registry _exports;  // the process-wide registry
+
+void _check_line(int pin);
+
+#endif // REGISTRY_HPP
@@ -0,0 +1,265 @@
+#include "sim.hpp"
+#include "constants.hpp"
+#include "event.hpp"
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+static int _pwm_key(int chip, int pin) {
+    return (chip << 16) | pin;
+}
+
+// Quadrature state for count mod 4: A leads B when counting up
+static const int _quadrature[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+
+SimRig::SimRig(VirtualClock& clock, int64_t step_ns) : clock(clock), step_ns(step_ns), generated(0) {
+    if (step_ns <= 0) {
+        throw std::invalid_argument("Simulation step must be positive");
+    }
+    // Takes over the library until destroyed
+    set_clock(&clock);
+    set_sysfs_backend(this);
+}
+
+SimRig::~SimRig() {
+    set_sysfs_backend(nullptr);
+    set_clock(nullptr);
+}
+
+std::size_t SimRig::add_motor(const SimMotorConfig& config) {
+    std::lock_guard<std::mutex> guard(lock);
+    _motor motor;
+    motor.config = config;
+    motor.position = config.position;
+    motor.velocity = 0;
+    motor.count = static_cast<long>(std::floor(config.position * config.counts_per_unit));
+    motors.push_back(motor);
+
+    // Sensor lines start out consistent with the initial position
+    if (config.limit_low_pin >= 0) pins[config.limit_low_pin].level = (motor.position <= config.limit_low);
+    if (config.limit_high_pin >= 0) pins[config.limit_high_pin].level = (motor.position >= config.limit_high);
+    if (config.encoder_a_pin >= 0 && config.encoder_b_pin >= 0) {
+        int phase = ((motor.count % 4) + 4) % 4;
+        pins[config.encoder_a_pin].level = _quadrature[phase][0];
+        pins[config.encoder_b_pin].level = _quadrature[phase][1];
+    }
+    return motors.size() - 1;
+}
+
+double SimRig::position(std::size_t motor) {
+    std::lock_guard<std::mutex> guard(lock);
+    return motors.at(motor).position;
+}
+
+double SimRig::velocity(std::size_t motor) {
+    std::lock_guard<std::mutex> guard(lock);
+    return motors.at(motor).velocity;
+}
+
+long SimRig::encoder_count(std::size_t motor) {
+    std::lock_guard<std::mutex> guard(lock);
+    return motors.at(motor).count;
+}
+
+unsigned long SimRig::edges_generated() {
+    std::lock_guard<std::mutex> guard(lock);
+    return generated;
+}
+
+void SimRig::set_level(int pin, int level) {
+    // Caller holds the lock; queues an edge if the pin's trigger matches
+    _pin& p = pins[pin];
+    if (p.level == level) {
+        return;
+    }
+    p.level = level;
+    bool rising = (level == GPIO.getattr<int>("HIGH"));
+    if (p.trigger == GPIO.getattr<int>("BOTH")
+            || (rising && p.trigger == GPIO.getattr<int>("RISING"))
+            || (!rising && p.trigger == GPIO.getattr<int>("FALLING"))) {
+        p.edges++;
+        generated++;
+        pending.push_back(pin);
+    }
+}
+
+void SimRig::set_input(int pin, int level) {
+    std::vector<int> edges;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        set_level(pin, level ? 1 : 0);
+        edges.swap(pending);
+    }
+    edge_seen.notify_all();
+    for (int line : edges) {
+        deliver_edge(line);
+    }
+}
+
+void SimRig::step(double dt) {
+    // Caller holds the lock
+    for (_motor& motor : motors) {
+        const SimMotorConfig& config = motor.config;
+
+        double command = 0;
+        auto it = pwms.find(_pwm_key(config.pwm_chip, config.pwm_channel));
+        if (it != pwms.end() && it->second.enabled && it->second.period > 0) {
+            command = static_cast<double>(it->second.duty) / it->second.period;
+            if (it->second.inverted) {
+                command = 1 - command;
+            }
+        }
+        if (config.direction_pin >= 0 && pins[config.direction_pin].level == 0) {
+            command = -command;
+        }
+
+        double target = command * config.max_speed;
+        if (config.time_constant > 0) {
+            motor.velocity += (target - motor.velocity) * std::min(1.0, dt / config.time_constant);
+        } else {
+            motor.velocity = target;
+        }
+        motor.position += motor.velocity * dt;
+        if (motor.position <= config.min_position) {
+            motor.position = config.min_position;
+            motor.velocity = std::max(0.0, motor.velocity);
+        }
+        if (motor.position >= config.max_position) {
+            motor.position = config.max_position;
+            motor.velocity = std::min(0.0, motor.velocity);
+        }
+
+        if (config.limit_low_pin >= 0) {
+            set_level(config.limit_low_pin, motor.position <= config.limit_low);
+        }
+        if (config.limit_high_pin >= 0) {
+            set_level(config.limit_high_pin, motor.position >= config.limit_high);
+        }
+
+        if (config.encoder_a_pin >= 0 && config.encoder_b_pin >= 0 && config.counts_per_unit > 0) {
+            long count = static_cast<long>(std::floor(motor.position * config.counts_per_unit));
+            while (motor.count != count) {  // walk every intermediate state, one line changes per count
+                motor.count += (count > motor.count) ? 1 : -1;
+                int phase = ((motor.count % 4) + 4) % 4;
+                set_level(config.encoder_a_pin, _quadrature[phase][0]);
+                set_level(config.encoder_b_pin, _quadrature[phase][1]);
+            }
+        }
+    }
+}
+
+void SimRig::run_for(int64_t duration_ns) {
+    int64_t end = clock.now_ns() + duration_ns;
+    std::vector<int> edges;
+    while (true) {
+        int64_t now = clock.now_ns();
+        if (now >= end) {
+            break;
+        }
+        int64_t next = std::min(end, now + step_ns);
+        clock.advance_to(next);  // control loops run their cycles up to `next`
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            step((next - now) / 1e9);
+            edges.swap(pending);
+        }
+        edge_seen.notify_all();
+        for (int line : edges) {
+            deliver_edge(line);
+        }
+        edges.clear();
+    }
+}
+
+void SimRig::export_pin(int pin) {
+    std::lock_guard<std::mutex> guard(lock);
+    pins[pin].exported = true;
+}
+
+void SimRig::unexport_pin(int pin) {
+    std::lock_guard<std::mutex> guard(lock);
+    _pin& p = pins[pin];
+    p.exported = false;
+    p.direction = -1;
+    p.trigger = GPIO.getattr<int>("NONE");
+}
+
+void SimRig::direction(int pin, int dir) {
+    std::lock_guard<std::mutex> guard(lock);
+    pins[pin].direction = dir;
+}
+
+int SimRig::input(int pin) {
+    std::lock_guard<std::mutex> guard(lock);
+    return pins[pin].level;
+}
+
+void SimRig::output(int pin, int value) {
+    std::lock_guard<std::mutex> guard(lock);
+    pins[pin].level = value ? 1 : 0;
+}
+
+void SimRig::edge(int pin, int trigger) {
+    std::lock_guard<std::mutex> guard(lock);
+    pins[pin].trigger = trigger;
+}
+
+bool SimRig::wait_edge(int pin, int64_t timeout_ns) {
+    // Timeout in virtual time; run_for() must be driven from another thread
+    std::unique_lock<std::mutex> guard(lock);
+    unsigned long seen = pins[pin].edges;
+    int64_t deadline = (timeout_ns < 0) ? -1 : clock.now_ns() + timeout_ns;
+    while (pins[pin].edges == seen) {
+        if (deadline >= 0 && clock.now_ns() >= deadline) {
+            return false;
+        }
+        edge_seen.wait(guard);
+    }
+    return true;
+}
+
+void SimRig::pwm_export(int chip, int pin) {
+    std::lock_guard<std::mutex> guard(lock);
+    pwms[_pwm_key(chip, pin)].exported = true;
+}
+
+void SimRig::pwm_unexport(int chip, int pin) {
+    std::lock_guard<std::mutex> guard(lock);
+    pwms.erase(_pwm_key(chip, pin));
+}
+
+void SimRig::pwm_enable(int chip, int pin, bool enabled) {
+    std::lock_guard<std::mutex> guard(lock);
+    pwms[_pwm_key(chip, pin)].enabled = enabled;
+}
+
+bool SimRig::pwm_enabled(int chip, int pin) {
+    std::lock_guard<std::mutex> guard(lock);
+    return pwms[_pwm_key(chip, pin)].enabled;
+}
+
+void SimRig::pwm_polarity(int chip, int pin, bool invert) {
+    std::lock_guard<std::mutex> guard(lock);
+    pwms[_pwm_key(chip, pin)].inverted = invert;
+}
+
+int64_t SimRig::pwm_period(int chip, int pin) {
+    std::lock_guard<std::mutex> guard(lock);
+    return pwms[_pwm_key(chip, pin)].period;
+}
+
+int64_t SimRig::pwm_duty_cycle(int chip, int pin) {
+    std::lock_guard<std::mutex> guard(lock);
+    return pwms[_pwm_key(chip, pin)].duty;
+}
+
+void SimRig::pwm_set_period(int chip, int pin, int64_t period) {
+    std::lock_guard<std::mutex> guard(lock);
+    pwms[_pwm_key(chip, pin)].period = period;
+}
+
+void SimRig::pwm_set_duty_cycle(int chip, int pin, int64_t duty_cycle) {
+    std::lock_guard<std::mutex> guard(lock);
+    pwms[_pwm_key(chip, pin)].duty = duty_cycle;
+}
@@ -0,0 +1,108 @@
+#ifndef SIM_HPP
+#define SIM_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "clock.hpp"
+#include "sysfs.hpp"
+
+// Simulated PTZ rig on virtual time.
+// Installed as the SysfsBackend, it stands in for the GPIO and PWM lines:
+// PWM duty and a direction output drive motors with first-order inertia,
+// and the motors' positions produce limit-switch and quadrature encoder
+// edges through the normal edge engine. run_for() moves the VirtualClock,
+// so control loops and timeouts run as fast as the host allows.
+
+struct SimMotorConfig {
+    int pwm_chip = 0;
+    int pwm_channel = 0;
+    int direction_pin = -1;     // output, HIGH drives towards max_position
+    double max_speed = 1;       // units per second at 100% duty
+    double time_constant = 0;   // seconds, 0 for no inertia
+    double min_position = -1e9; // hard stops
+    double max_position = 1e9;
+    double position = 0;
+
+    int limit_low_pin = -1;     // reads HIGH while position <= limit_low
+    double limit_low = 0;
+    int limit_high_pin = -1;    // reads HIGH while position >= limit_high
+    double limit_high = 0;
+
+    int encoder_a_pin = -1;     // quadrature outputs
+    int encoder_b_pin = -1;
+    double counts_per_unit = 0;
+};
+
+class SimRig : public SysfsBackend {
+public:
+    SimRig(VirtualClock& clock, int64_t step_ns = 100000);
+    ~SimRig();
+
+    std::size_t add_motor(const SimMotorConfig& config);
+    double position(std::size_t motor);
+    double velocity(std::size_t motor);
+    long encoder_count(std::size_t motor);
+    void set_input(int pin, int level);
+    void run_for(int64_t duration_ns);
+    unsigned long edges_generated();
+
+    void export_pin(int pin) override;
+    void unexport_pin(int pin) override;
+    void direction(int pin, int dir) override;
+    int input(int pin) override;
+    void output(int pin, int value) override;
+    void edge(int pin, int trigger) override;
+    bool wait_edge(int pin, int64_t timeout_ns) override;
+
+    void pwm_export(int chip, int pin) override;
+    void pwm_unexport(int chip, int pin) override;
+    void pwm_enable(int chip, int pin, bool enabled) override;
+    bool pwm_enabled(int chip, int pin) override;
+    void pwm_polarity(int chip, int pin, bool invert) override;
+    int64_t pwm_period(int chip, int pin) override;
+    int64_t pwm_duty_cycle(int chip, int pin) override;
+    void pwm_set_period(int chip, int pin, int64_t period) override;
+    void pwm_set_duty_cycle(int chip, int pin, int64_t duty_cycle) override;
+
+private:
+    struct _pin {
+        bool exported = false;
+        int direction = -1;
+        int level = 0;
+        int trigger = 0;
+        unsigned long edges = 0;
+    };
+
+    struct _pwm {
+        bool exported = false;
+        bool enabled = false;
+        bool inverted = false;
+        int64_t period = 0;
+        int64_t duty = 0;
+    };
+
+    struct _motor {
+        SimMotorConfig config;
+        double position;
+        double velocity;
+        long count;
+    };
+
+    void set_level(int pin, int level);
+    void step(double dt);
+
+    VirtualClock& clock;
+    int64_t step_ns;
+    std::mutex lock;
+    std::condition_variable edge_seen;
+    std::unordered_map<int, _pin> pins;
+    std::unordered_map<int, _pwm> pwms;
+    std::vector<_motor> motors;
+    std::vector<int> pending;  // edges to deliver once the lock is released
+    unsigned long generated;
+};
+
+#endif // SIM_HPP
@@ -1,13 +1,42 @@
 #include "sysfs.hpp"
 #include "constants.hpp"
+#include "clock.hpp"
+#include <atomic>
+#include <cerrno>
+#include <system_error>
 #include <unistd.h>
 #include <fcntl.h>
 #include <cmath>
+#include <cstring>
+#include <stdexcept>
 
 const double WAIT_PERMISSION_TIMEOUT = 1.0;
 
+static std::atomic<SysfsBackend*> _backend{nullptr};
+static char _root[64] = "";
+
+void set_sysfs_backend(SysfsBackend* backend) {
+    // Install before any pin is set up, nullptr goes back to the kernel
+    _backend.store(backend, std::memory_order_release);
+}
+
+SysfsBackend* sysfs_backend() {
+    return _backend.load(std::memory_order_acquire);
+}
+
+void set_sysfs_root(const std::string& root) {
+    if (root.size() >= sizeof(_root)) {
+        throw std::length_error("sysfs root " + root + " is too long");
+    }
+    std::memcpy(_root, root.c_str(), root.size() + 1);
+}
+
+const char* sysfs_root() {
+    return _root;
+}
+
 ValueDescriptor::ValueDescriptor(int pin, const std::string& mode) {
-    path = "/sys/class/gpio/gpio" + std::to_string(pin) + "/value";
+    path = std::string(_root) + "/sys/class/gpio/gpio" + std::to_string(pin) + "/value";
     await_permissions(path);
     if (mode == "r") {
         fp.open(path, std::ios::in);
@@ -26,165 +55,376 @@ std::fstream& ValueDescriptor::get() {
     return fp;
 }
 
+// Builds sysfs paths in a fixed buffer, the longest is well under its size
+class _sysfs_path {
+public:
+    _sysfs_path() : length(0) {
+        buffer[0] = '\0';
+    }
+
+    _sysfs_path& operator<<(const char* text) {
+        while (*text && length < sizeof(buffer) - 1) {
+            buffer[length++] = *text++;
+        }
+        buffer[length] = '\0';
+        return *this;
+    }
+
+    _sysfs_path& operator<<(int value) {
+        char digits[SYSFS_INT_CHARS];
+        std::size_t n = sysfs_format_int(digits, value);
+        for (std::size_t i = 0; i < n && length < sizeof(buffer) - 1; i++) {
+            buffer[length++] = digits[i];
+        }
+        buffer[length] = '\0';
+        return *this;
+    }
+
+    const char* c_str() const {
+        return buffer;
+    }
+
+private:
+    char buffer[160];  // room for a 63 character root
+    std::size_t length;
+};
+
+static _sysfs_path _gpio_path(int pin, const char* attr) {
+    _sysfs_path path;
+    path << _root << "/sys/class/gpio/gpio" << pin << "/" << attr;
+    return path;
+}
+
+static _sysfs_path _pwm_path(int chip, int pin, const char* attr) {
+    _sysfs_path path;
+    path << _root << "/sys/class/pwm/pwmchip" << chip << "/pwm" << pin << "/" << attr;
+    return path;
+}
+
+static _sysfs_path _pwmchip_path(int chip, const char* attr) {
+    _sysfs_path path;
+    path << _root << "/sys/class/pwm/pwmchip" << chip << "/" << attr;
+    return path;
+}
+
+static void _write_attr(const char* path, const char* text, std::size_t length) {
+    // Failures are ignored like the stream writes this replaces, e.g. exporting an exported pin
+    await_permissions(path);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    ssize_t written = write(fd, text, length);
+    (void)written;
+    close(fd);
+}
+
+static void _write_attr(const char* path, int64_t value) {
+    char buffer[SYSFS_INT_CHARS];
+    _write_attr(path, buffer, sysfs_format_int(buffer, value));
+}
+
+static int64_t _read_attr(const char* path) {
+    // Unlike writes, a failed read throws: 0 would pass for a real period or duty cycle
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), std::string("open ") + path);
+    }
+    int64_t value;
+    try {
+        value = sysfs_read_int(fd);
+    } catch (const std::system_error& e) {
+        close(fd);
+        throw std::system_error(e.code(), std::string("read ") + path);
+    }
+    close(fd);
+    return value;
+}
+
+std::size_t sysfs_format_int(char* buffer, int64_t value) {
+    char digits[SYSFS_INT_CHARS];
+    std::size_t count = 0;
+    uint64_t magnitude = (value < 0) ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+    do {
+        digits[count++] = static_cast<char>('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+
+    std::size_t length = 0;
+    if (value < 0) {
+        buffer[length++] = '-';
+    }
+    while (count) {
+        buffer[length++] = digits[--count];
+    }
+    return length;
+}
+
+bool sysfs_parse_int(const char* buffer, std::size_t length, int64_t& value) {
+    // Accepts what the kernel prints: optional sign, digits, trailing newline or NUL
+    std::size_t i = 0;
+    bool negative = false;
+    if (i < length && (buffer[i] == '-' || buffer[i] == '+')) {
+        negative = (buffer[i] == '-');
+        i++;
+    }
+    std::size_t first = i;
+    uint64_t magnitude = 0;
+    while (i < length && buffer[i] >= '0' && buffer[i] <= '9') {
+        uint64_t digit = buffer[i] - '0';
+        if (magnitude > (UINT64_MAX - digit) / 10) {
+            return false;
+        }
+        magnitude = magnitude * 10 + digit;
+        i++;
+    }
+    if (i == first || (i < length && buffer[i] != '\n' && buffer[i] != '\0')) {
+        return false;
+    }
+    if (magnitude > static_cast<uint64_t>(INT64_MAX) + (negative ? 1 : 0)) {
+        return false;
+    }
+    value = negative ? static_cast<int64_t>(0 - magnitude) : static_cast<int64_t>(magnitude);
+    return true;
+}
+
+int64_t sysfs_read_int(int fd) {
+    char buffer[SYSFS_INT_CHARS + 1];
+    ssize_t n = pread(fd, buffer, sizeof(buffer), 0);
+    if (n < 0) {
+        throw std::system_error(errno, std::generic_category(), "pread");
+    }
+    int64_t value = 0;
+    if (!sysfs_parse_int(buffer, n, value)) {  // also an empty read
+        throw std::system_error(EINVAL, std::generic_category(), "pread: not an integer");
+    }
+    return value;
+}
+
+void sysfs_write_int(int fd, int64_t value) {
+    char buffer[SYSFS_INT_CHARS];
+    ssize_t length = sysfs_format_int(buffer, value);
+    if (pwrite(fd, buffer, length, 0) != length) {
+        throw std::system_error(errno, std::generic_category(), "pwrite");
+    }
+}
+
 void await_permissions(const std::string& path) {
-    auto start_time = std::chrono::steady_clock::now();
+    await_permissions(path.c_str());
+}
+
+void await_permissions(const char* path) {
+    if (sysfs_backend()) {
+        return;
+    }
+
+    int64_t start_time = monotonic_ns();
 
     auto timed_out = [&]() {
-        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count() >= WAIT_PERMISSION_TIMEOUT;
+        return (monotonic_ns() - start_time) / 1e9 >= WAIT_PERMISSION_TIMEOUT;
     };
 
-    while (access(path.c_str(), W_OK) != 0 && !timed_out()) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    while (access(path, W_OK) != 0 && !timed_out()) {
+        sleep_for_ns(100000000);
     }
 }
 
 void export_pin(int pin) {
-    std::string path = "/sys/class/gpio/export";
-    await_permissions(path);
-    std::ofstream fp(path);
-    fp << pin;
+    if (SysfsBackend* backend = sysfs_backend()) {
+        backend->export_pin(pin);
+        return;
+    }
+    _sysfs_path path;
+    path << _root << "/sys/class/gpio/export";
+    _write_attr(path.c_str(), pin);
 }
 
 void unexport_pin(int pin) {
-    std::string path = "/sys/class/gpio/unexport";
-    await_permissions(path);
-    std::ofstream fp(path);
-    fp << pin;
+    if (SysfsBackend* backend = sysfs_backend()) {
+        backend->unexport_pin(pin);
+        return;
+    }
+    _sysfs_path path;
+    path << _root << "/sys/class/gpio/unexport";
+    _write_attr(path.c_str(), pin);
+}
+
+int open_value(int pin) {
+    _sysfs_path path = _gpio_path(pin, "value");
+    await_permissions(path.c_str());
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), std::string("open ") + path.c_str());
+    }
+    return fd;
 }
 
 void direction(int pin, int dir) {
+    if (SysfsBackend* backend = sysfs_backend()) {
+        backend->direction(pin, dir);
+        return;
+    }
     assert(dir == GPIO.getattr<int>("IN") || dir == GPIO.getattr<int>("OUT"));
-    std::string path = "/sys/class/gpio/gpio" + std::to_string(pin) + "/direction";
-    await_permissions(path);
-    std::ofstream fp(path);
     if (dir == GPIO.getattr<int>("IN")) {
-        fp << "in";
+        _write_attr(_gpio_path(pin, "direction").c_str(), "in", 2);
     } else {
-        fp << "out";
+        _write_attr(_gpio_path(pin, "direction").c_str(), "out", 3);
     }
 }
 
 int input(int pin) {
-    ValueDescriptor vd(pin);
-    std::string value;
-    vd.get() >> value;
-    return (value == std::to_string(GPIO.getattr<int>("LOW"))) ? GPIO.getattr<int>("LOW") : GPIO.getattr<int>("HIGH");
+    if (SysfsBackend* backend = sysfs_backend()) {
+        return backend->input(pin);
+    }
+    _sysfs_path path = _gpio_path(pin, "value");
+    await_permissions(path.c_str());
+    char value = '0';
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (read(fd, &value, 1) != 1) {
+            value = '0';
+        }
+        close(fd);
+    }
+    return (value == '0') ? GPIO.getattr<int>("LOW") : GPIO.getattr<int>("HIGH");
 }
 
 void output(int pin, int value) {
-    std::string str_value = value ? "1" : "0";
-    ValueDescriptor vd(pin, "w");
-    vd.get() << str_value;
+    if (SysfsBackend* backend = sysfs_backend()) {
+        backend->output(pin, value);
+        return;
+    }
+    _write_attr(_gpio_path(pin, "value").c_str(), value ? "1" : "0", 1);
 }
 
 void edge(int pin, int trigger) {
+    if (SysfsBackend* backend = sysfs_backend()) {
+        backend->edge(pin, trigger);
+        return;
+    }
     assert(trigger == GPIO.getattr<int>("NONE") || trigger == GPIO.getattr<int>("RISING") || trigger == GPIO.getattr<int>("FALLING") || trigger == GPIO.getattr<int>("BOTH"));
-    std::string path = "/sys/class/gpio/gpio" + std::to_string(pin) + "/edge";
-    await_permissions(path);
-    std::ofstream fp(path);
+    _sysfs_path path = _gpio_path(pin, "edge");
     switch (trigger) {
-        case 0: fp << "none"; break;
-        case 1: fp << "rising"; break;
-        case 2: fp << "falling"; break;
-        case 3: fp << "both"; break;
+        case 0: _write_attr(path.c_str(), "none", 4); break;
+        case 1: _write_attr(path.c_str(), "rising", 6); break;
+        case 2: _write_attr(path.c_str(), "falling", 7); break;
+        case 3: _write_attr(path.c_str(), "both", 4); break;
     }
 }
 
 void PWM_Export(int chip, int pin) {
-    std::string path = "/sys/class/pwm/pwmchip" + std::to_string(chip) + "/export";
-    await_permissions(path);
-    std::ofstream fp(path);
-    fp << pin;
+    if (SysfsBackend* backend = sysfs_backend()) {
+        backend->pwm_export(chip, pin);
+        return;
+    }
+    _write_attr(_pwmchip_path(chip, "export").c_str(), pin);
 }
 
 void PWM_Unexport(int chip, int pin) {
-    std::string path = "/sys/class/pwm/pwmchip" + std::to_string(chip) + "/unexport";
-    await_permissions(path);
-    std::ofstream fp(path);
-    fp << pin;
+    if (SysfsBackend* backend = sysfs_backend()) {
+        backend->pwm_unexport(chip, pin);
+        return;
+    }
+    _write_attr(_pwmchip_path(chip, "unexport").c_str(), pin);
 }
 
 void PWM_Enable(int chip, int pin) {
-    std::string path = "/sys/class/pwm/pwmchip" + std::to_string(chip) + "/pwm" + std::to_string(pin) + "/enable";
-    await_permissions(path);
-    std::ofstream fp(path);
-    fp << 1;
+    if (SysfsBackend* backend = sysfs_backend()) {
+        backend->pwm_enable(chip, pin, true);
+        return;
+    }
+    _write_attr(_pwm_path(chip, pin, "enable").c_str(), "1", 1);
 }
 
 void PWM_Disable(int chip, int pin) {
-    std::string path = "/sys/class/pwm/pwmchip" + std::to_string(chip) + "/pwm" + std::to_string(pin) + "/enable";
-    await_permissions(path);
-    std::ofstream fp(path);
-    fp << 0;
+    if (SysfsBackend* backend = sysfs_backend()) {
+        backend->pwm_enable(chip, pin, false);
+        return;
+    }
+    _write_attr(_pwm_path(chip, pin, "enable").c_str(), "0", 1);
 }
 
 void PWM_Polarity(int chip, int pin, bool invert) {
-    std::string path = "/sys/class/pwm/pwmchip" + std::to_string(chip) + "/pwm" + std::to_string(pin) + "/polarity";
-    await_permissions(path);
-    std::ofstream fp(path);
+    if (SysfsBackend* backend = sysfs_backend()) {
+        backend->pwm_polarity(chip, pin, invert);
+        return;
+    }
     if (invert) {
-        fp << "inversed";
+        _write_attr(_pwm_path(chip, pin, "polarity").c_str(), "inversed", 8);
     } else {
-        fp << "normal";
+        _write_attr(_pwm_path(chip, pin, "polarity").c_str(), "normal", 6);
     }
 }
 
-void PWM_Period(int chip, int pin, int pwm_period) {
-    std::string duty_cycle_path = "/sys/class/pwm/pwmchip" + std::to_string(chip) + "/pwm" + std::to_string(pin) + "/duty_cycle";
-    std::ifstream fp(duty_cycle_path);
-    int current_duty_cycle_period;
-    fp >> current_duty_cycle_period;
-    fp.close();
-
-    if (current_duty_cycle_period > pwm_period) {
-        std::cerr << "Error: the new duty cycle period must be less than or equal to the PWM Period: " << pwm_period << std::endl;
-        std::cerr << "New Duty Cycle = " << current_duty_cycle_period << " Current PWM Period = " << pwm_period << std::endl;
-        std::terminate();
+int64_t PWM_Get_Period_ns(int chip, int pin) {
+    if (SysfsBackend* backend = sysfs_backend()) {
+        return backend->pwm_period(chip, pin);
     }
-
-    std::string path = "/sys/class/pwm/pwmchip" + std::to_string(chip) + "/pwm" + std::to_string(pin) + "/period";
-    await_permissions(path);
-    std::ofstream fp_out(path);
-    fp_out << pwm_period;
+    return _read_attr(_pwm_path(chip, pin, "period").c_str());
 }
 
-void PWM_Frequency(int chip, int pin, double pwm_frequency) {
-    int pwm_period = static_cast<int>(round((1 / pwm_frequency) * 1e9));
-    std::string path = "/sys/class/pwm/pwmchip" + std::to_string(chip) + "/pwm" + std::to_string(pin) + "/period";
-    await_permissions(path);
-    std::ofstream fp(path);
-    fp << pwm_period;
+int64_t PWM_Get_Duty_Cycle_ns(int chip, int pin) {
+    if (SysfsBackend* backend = sysfs_backend()) {
+        return backend->pwm_duty_cycle(chip, pin);
+    }
+    return _read_attr(_pwm_path(chip, pin, "duty_cycle").c_str());
 }
 
-void PWM_Duty_Cycle_Percent(int chip, int pin, double Duty_cycle) {
-    std::string PWM_period_path = "/sys/class/pwm/pwmchip" + std::to_string(chip) + "/pwm" + std::to_string(pin) + "/period";
-    std::ifstream fp(PWM_period_path);
-    int current_period;
-    fp >> current_period;
-    fp.close();
+bool PWM_Get_Enabled(int chip, int pin) {
+    if (SysfsBackend* backend = sysfs_backend()) {
+        return backend->pwm_enabled(chip, pin);
+    }
+    return _read_attr(_pwm_path(chip, pin, "enable").c_str()) != 0;
+}
 
-    int new_duty_cycle = static_cast<int>(round(Duty_cycle / 100 * current_period));
+static void _set_period_ns(int chip, int pin, int64_t period_ns) {
+    if (SysfsBackend* backend = sysfs_backend()) {
+        backend->pwm_set_period(chip, pin, period_ns);
+        return;
+    }
+    _write_attr(_pwm_path(chip, pin, "period").c_str(), period_ns);
+}
 
-    std::string path = "/sys/class/pwm/pwmchip" + std::to_string(chip) + "/pwm" + std::to_string(pin) + "/duty_cycle";
-    std::ofstream fp_out(path);
-    fp_out << new_duty_cycle;
+static void _set_duty_cycle_ns(int chip, int pin, int64_t duty_cycle_ns) {
+    if (SysfsBackend* backend = sysfs_backend()) {
+        backend->pwm_set_duty_cycle(chip, pin, duty_cycle_ns);
+        return;
+    }
+    _write_attr(_pwm_path(chip, pin, "duty_cycle").c_str(), duty_cycle_ns);
 }
 
-void PWM_Duty_Cycle(int chip, int pin, int Duty_cycle) {
-    std::string PWM_period_path = "/sys/class/pwm/pwmchip" + std::to_string(chip) + "/pwm" + std::to_string(pin) + "/period";
-    std::ifstream fp(PWM_period_path);
-    int current_period;
-    fp >> current_period;
-    fp.close();
+void PWM_Period_ns(int chip, int pin, int64_t period_ns) {
+    int64_t current_duty_cycle_period = PWM_Get_Duty_Cycle_ns(chip, pin);
+    if (current_duty_cycle_period > period_ns) {
+        std::cerr << "Error: the new duty cycle period must be less than or equal to the PWM Period: " << period_ns << std::endl;
+        std::cerr << "New Duty Cycle = " << current_duty_cycle_period << " Current PWM Period = " << period_ns << std::endl;
+        std::terminate();
+    }
+    _set_period_ns(chip, pin, period_ns);
+}
 
-    if (Duty_cycle > current_period) {
+void PWM_Duty_Cycle_ns(int chip, int pin, int64_t duty_cycle_ns) {
+    int64_t current_period = PWM_Get_Period_ns(chip, pin);
+    if (duty_cycle_ns > current_period) {
         std::cerr << "Error: the new duty cycle period must be less than or equal to the PWM Period: " << current_period << std::endl;
-        std::cerr << "New Duty Cycle = " << Duty_cycle << " Current PWM Period = " << current_period << std::endl;
+        std::cerr << "New Duty Cycle = " << duty_cycle_ns << " Current PWM Period = " << current_period << std::endl;
         std::terminate();
     }
+    _set_duty_cycle_ns(chip, pin, duty_cycle_ns);
+}
 
-    std::string path = "/sys/class/pwm/pwmchip" + std::to_string(chip) + "/pwm" + std::to_string(pin) + "/duty_cycle";
-    await_permissions(path);
-    std::ofstream fp_out(path);
-    fp_out << Duty_cycle;
+void PWM_Period(int chip, int pin, int pwm_period) {
+    PWM_Period_ns(chip, pin, pwm_period);
+}
+
+void PWM_Frequency(int chip, int pin, double pwm_frequency) {
+    _set_period_ns(chip, pin, llround((1 / pwm_frequency) * 1e9));
+}
+
+void PWM_Duty_Cycle_Percent(int chip, int pin, double Duty_cycle) {
+    _set_duty_cycle_ns(chip, pin, llround(Duty_cycle / 100 * PWM_Get_Period_ns(chip, pin)));
+}
+
+void PWM_Duty_Cycle(int chip, int pin, int Duty_cycle) {
+    PWM_Duty_Cycle_ns(chip, pin, Duty_cycle);
 }
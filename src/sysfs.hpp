@@ -7,6 +7,7 @@
 #include <chrono>
 #include <thread>
 #include <cassert>
+#include <cstdint>
 
 class ValueDescriptor {
 public:
@@ -19,7 +20,47 @@ private:
     std::fstream fp;
 };
 
+// Replaces the kernel behind the functions below, e.g. with a simulated rig (sim.hpp)
+class SysfsBackend {
+public:
+    virtual ~SysfsBackend() = default;
+    virtual void export_pin(int pin) = 0;
+    virtual void unexport_pin(int pin) = 0;
+    virtual void direction(int pin, int dir) = 0;
+    virtual int input(int pin) = 0;
+    virtual void output(int pin, int value) = 0;
+    virtual void edge(int pin, int trigger) = 0;
+    virtual bool wait_edge(int pin, int64_t timeout_ns) = 0;  // timeout_ns < 0 waits forever
+
+    virtual void pwm_export(int chip, int pin) = 0;
+    virtual void pwm_unexport(int chip, int pin) = 0;
+    virtual void pwm_enable(int chip, int pin, bool enabled) = 0;
+    virtual bool pwm_enabled(int chip, int pin) = 0;
+    virtual void pwm_polarity(int chip, int pin, bool invert) = 0;
+    virtual int64_t pwm_period(int chip, int pin) = 0;
+    virtual int64_t pwm_duty_cycle(int chip, int pin) = 0;
+    virtual void pwm_set_period(int chip, int pin, int64_t period) = 0;
+    virtual void pwm_set_duty_cycle(int chip, int pin, int64_t duty_cycle) = 0;
+};
+
+void set_sysfs_backend(SysfsBackend* backend);
+SysfsBackend* sysfs_backend();
+
+// Directory that holds sys/class/gpio and sys/class/pwm, "" for the real
+// tree. Tests point it at a fake tree; set it before any pin is set up.
+void set_sysfs_root(const std::string& root);
+const char* sysfs_root();
+int open_value(int pin);  // O_RDONLY fd on the line's value file for epoll, the caller closes it
+
 void await_permissions(const std::string& path);
+void await_permissions(const char* path);
+
+// Allocation-free integer I/O for sysfs attributes
+const std::size_t SYSFS_INT_CHARS = 21;  // "-9223372036854775808"
+std::size_t sysfs_format_int(char* buffer, int64_t value);  // no terminator, returns the length
+bool sysfs_parse_int(const char* buffer, std::size_t length, int64_t& value);
+int64_t sysfs_read_int(int fd);  // pread/pwrite at offset 0 on an open attribute, std::system_error on failure
+void sysfs_write_int(int fd, int64_t value);
 
 void export_pin(int pin);
 void unexport_pin(int pin);
@@ -38,4 +79,11 @@ void PWM_Frequency(int chip, int pin, double pwm_frequency);
 void PWM_Duty_Cycle_Percent(int chip, int pin, double Duty_cycle);
 void PWM_Duty_Cycle(int chip, int pin, int Duty_cycle);
 
+// Integer nanosecond variants, no floating point on the way to the kernel
+void PWM_Period_ns(int chip, int pin, int64_t period_ns);
+void PWM_Duty_Cycle_ns(int chip, int pin, int64_t duty_cycle_ns);
+int64_t PWM_Get_Period_ns(int chip, int pin);
+int64_t PWM_Get_Duty_Cycle_ns(int chip, int pin);
+bool PWM_Get_Enabled(int chip, int pin);
+
 #endif // SYSFS_HPP
@@ -0,0 +1,240 @@
+#include "telemetry.hpp"
+#include "clock.hpp"
+#include <new>
+#include <mutex>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+static std::mutex _telemetry_lock;
+static std::atomic<_telemetry_shm*> _telemetry{nullptr};
+static std::string _telemetry_name;
+static std::atomic<int> _telemetry_writers{0};  // sections that may still touch the mapping
+
+// Writers all live in this process and serialize on a priority-inheriting mutex,
+// so a SCHED_FIFO thread waiting for a lower-priority one sleeps and boosts it
+static pthread_mutex_t _writer_lock = [] {
+    pthread_mutex_t mutex;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(&mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return mutex;
+}();
+
+// RAII seqlock writer section. Does nothing while telemetry is not started,
+// which costs the hot paths a single relaxed load.
+class _telemetry_write {
+public:
+    _telemetry_write() : shm(nullptr) {
+        if (!_telemetry.load(std::memory_order_relaxed)) {
+            return;
+        }
+        _telemetry_writers.fetch_add(1);  // pins the mapping, telemetry_stop() waits for it
+        shm = _telemetry.load();
+        if (!shm) {
+            _telemetry_writers.fetch_sub(1);
+            return;
+        }
+        pthread_mutex_lock(&_writer_lock);
+        seq = shm->seq.load(std::memory_order_relaxed);
+        shm->seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    ~_telemetry_write() {
+        if (!shm) {
+            return;
+        }
+        shm->data.timestamp_ns = static_cast<uint64_t>(monotonic_ns());
+        shm->data.updates++;
+        shm->seq.store(seq + 2, std::memory_order_release);
+        pthread_mutex_unlock(&_writer_lock);
+        _telemetry_writers.fetch_sub(1, std::memory_order_release);
+    }
+
+    _telemetry_shm* shm;
+
+private:
+    uint32_t seq = 0;
+};
+
+void telemetry_start(const std::string& name) {
+    std::lock_guard<std::mutex> lock(_telemetry_lock);
+    if (_telemetry.load()) {
+        throw std::runtime_error("Telemetry is already started");
+    }
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "shm_open " + name);
+    }
+    if (ftruncate(fd, sizeof(_telemetry_shm)) != 0) {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), "ftruncate " + name);
+    }
+    void* addr = mmap(nullptr, sizeof(_telemetry_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "mmap " + name);
+    }
+
+    _telemetry_shm* shm = new (addr) _telemetry_shm;
+    shm->seq.store(0);
+    std::memset(&shm->data, 0, sizeof(shm->data));
+    std::memset(shm->data.level, -1, sizeof(shm->data.level));
+    for (int i = 0; i < TELEMETRY_PWM_CHANNELS; i++) {
+        shm->data.pwm[i].chip = -1;
+    }
+    shm->magic = TELEMETRY_MAGIC;
+    shm->version = TELEMETRY_VERSION;
+
+    _telemetry_name = name;
+    _telemetry.store(shm, std::memory_order_release);
+}
+
+void telemetry_stop() {
+    // Safe while outputs and edge workers are still running: new sections see
+    // the null pointer, and the mapping goes away once the last one has left
+    std::lock_guard<std::mutex> lock(_telemetry_lock);
+    _telemetry_shm* shm = _telemetry.exchange(nullptr);
+    if (shm) {
+        while (_telemetry_writers.load(std::memory_order_acquire) != 0) {
+            std::this_thread::yield();
+        }
+        munmap(shm, sizeof(_telemetry_shm));
+        shm_unlink(_telemetry_name.c_str());
+    }
+}
+
+void telemetry_edge(int pin) {
+    _telemetry_write w;
+    if (w.shm && 0 <= pin && pin < MAX_GPIO_LINES) {
+        w.shm->data.edges[pin]++;
+    }
+}
+
+void telemetry_level(int pin, int level) {
+    _telemetry_write w;
+    if (w.shm && 0 <= pin && pin < MAX_GPIO_LINES) {
+        w.shm->data.level[pin] = static_cast<int8_t>(level);
+    }
+}
+
+void telemetry_output(int pin, int level) {
+    _telemetry_write w;
+    if (w.shm && 0 <= pin && pin < MAX_GPIO_LINES) {
+        w.shm->data.level[pin] = static_cast<int8_t>(level);
+        w.shm->data.writes[pin]++;
+    }
+}
+
+static TelemetryPWM* _pwm_slot(_telemetry_shm* shm, int chip, int channel) {
+    // Caller is inside the seqlock; nullptr once all slots are taken
+    TelemetryPWM* free_slot = nullptr;
+    for (int i = 0; i < TELEMETRY_PWM_CHANNELS; i++) {
+        TelemetryPWM& pwm = shm->data.pwm[i];
+        if (pwm.chip == chip && pwm.channel == channel) {
+            return &pwm;
+        }
+        if (pwm.chip == -1 && !free_slot) {
+            free_slot = &pwm;
+        }
+    }
+    if (free_slot) {
+        free_slot->chip = chip;
+        free_slot->channel = channel;
+        free_slot->period_ns = 0;
+        free_slot->duty_ns = 0;
+        free_slot->enabled = -1;
+    }
+    return free_slot;
+}
+
+void telemetry_pwm(int chip, int channel, int64_t period_ns, int64_t duty_ns) {
+    _telemetry_write w;
+    if (!w.shm) {
+        return;
+    }
+    if (TelemetryPWM* pwm = _pwm_slot(w.shm, chip, channel)) {
+        pwm->period_ns = period_ns;
+        pwm->duty_ns = duty_ns;
+    }
+}
+
+void telemetry_pwm_enabled(int chip, int channel, bool enabled) {
+    _telemetry_write w;
+    if (!w.shm) {
+        return;
+    }
+    if (TelemetryPWM* pwm = _pwm_slot(w.shm, chip, channel)) {
+        pwm->enabled = enabled ? 1 : 0;
+    }
+}
+
+void telemetry_axis(int axis, double position, double target, double velocity) {
+    _telemetry_write w;
+    if (w.shm && 0 <= axis && axis < TELEMETRY_AXES) {
+        TelemetryAxis& a = w.shm->data.axis[axis];
+        a.position = position;
+        a.target = target;
+        a.velocity = velocity;
+    }
+}
+
+void telemetry_limit(int axis, int limit) {
+    _telemetry_write w;
+    if (w.shm && 0 <= axis && axis < TELEMETRY_AXES) {
+        w.shm->data.axis[axis].limit = limit;
+    }
+}
+
+TelemetryReader::TelemetryReader(const std::string& name) : shm(nullptr), retried(0) {
+    int fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "shm_open " + name);
+    }
+    void* addr = mmap(nullptr, sizeof(_telemetry_shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "mmap " + name);
+    }
+    shm = static_cast<const _telemetry_shm*>(addr);
+    if (shm->magic != TELEMETRY_MAGIC || shm->version != TELEMETRY_VERSION) {
+        munmap(const_cast<_telemetry_shm*>(shm), sizeof(_telemetry_shm));
+        throw std::runtime_error("Incompatible telemetry segment " + name);
+    }
+}
+
+TelemetryReader::~TelemetryReader() {
+    munmap(const_cast<_telemetry_shm*>(shm), sizeof(_telemetry_shm));
+}
+
+void TelemetryReader::read(TelemetrySnapshot& snapshot) const {
+    while (true) {
+        uint32_t before = shm->seq.load(std::memory_order_acquire);
+        if (before & 1) {  // writer inside
+            retried++;
+            std::this_thread::yield();
+            continue;
+        }
+        std::memcpy(&snapshot, &shm->data, sizeof(snapshot));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (shm->seq.load(std::memory_order_relaxed) == before) {
+            return;
+        }
+        retried++;
+    }
+}
+
+unsigned long TelemetryReader::retries() const {
+    return retried;
+}
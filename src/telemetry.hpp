@@ -0,0 +1,74 @@
+#ifndef TELEMETRY_HPP
+#define TELEMETRY_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include "registry.hpp"
+
+// Fixed-layout telemetry block in shared memory.
+// Writers (control loop, edge workers, PWM) update it under a seqlock; readers
+// copy it out and retry if a writer was active, so they never block the writers.
+
+const uint32_t TELEMETRY_MAGIC = 0x50545a54;  // "PTZT"
+const uint32_t TELEMETRY_VERSION = 2;
+const int TELEMETRY_PWM_CHANNELS = 8;
+const int TELEMETRY_AXES = 4;  // pan, tilt, zoom, focus
+
+struct TelemetryPWM {
+    int32_t chip;      // -1 if the slot is unused
+    int32_t channel;
+    int64_t period_ns;
+    int64_t duty_ns;
+    int32_t enabled;   // -1 until the channel is enabled or disabled in this process
+};
+
+struct TelemetryAxis {
+    double position;
+    double target;
+    double velocity;
+    int32_t limit;  // 0 none, -1 at the low limit, 1 at the high limit (limit-switch edges)
+};
+
+struct TelemetrySnapshot {
+    uint64_t timestamp_ns;  // CLOCK_MONOTONIC of the last update
+    uint64_t updates;
+    int8_t level[MAX_GPIO_LINES];     // -1 if unknown
+    uint32_t edges[MAX_GPIO_LINES];
+    uint32_t writes[MAX_GPIO_LINES];  // sysfs writes actually issued
+    TelemetryPWM pwm[TELEMETRY_PWM_CHANNELS];
+    TelemetryAxis axis[TELEMETRY_AXES];
+};
+
+struct _telemetry_shm {
+    uint32_t magic;
+    uint32_t version;
+    alignas(64) std::atomic<uint32_t> seq;  // odd while a writer is inside
+    alignas(64) TelemetrySnapshot data;
+};
+
+void telemetry_start(const std::string& name = "/ptz-telemetry");
+void telemetry_stop();
+
+void telemetry_edge(int pin);
+void telemetry_level(int pin, int level);
+void telemetry_output(int pin, int level);
+void telemetry_pwm(int chip, int channel, int64_t period_ns, int64_t duty_ns);
+void telemetry_pwm_enabled(int chip, int channel, bool enabled);
+void telemetry_axis(int axis, double position, double target, double velocity);
+void telemetry_limit(int axis, int limit);
+
+class TelemetryReader {
+public:
+    TelemetryReader(const std::string& name = "/ptz-telemetry");
+    ~TelemetryReader();
+
+    void read(TelemetrySnapshot& snapshot) const;
+    unsigned long retries() const;
+
+private:
+    const _telemetry_shm* shm;
+    mutable unsigned long retried;
+};
+
+#endif // TELEMETRY_HPP
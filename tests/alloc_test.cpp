@@ -0,0 +1,201 @@
+// Checks that the value and PWM hot paths do not allocate once warmed up.
+// Global operator new is replaced with a counting one; each hot path runs in
+// a loop and the count must not move. The kernel paths run against a fake
+// sysfs tree of regular files under /tmp (see set_sysfs_root()).
+//
+// Build and run from src/, as one command:
+//   g++ -std=c++17 -I. ../tests/alloc_test.cpp sysfs.cpp pwm.cpp clock.cpp constants.cpp event.cpp
+//       realtime.cpp telemetry.cpp recorder.cpp idle.cpp registry.cpp -lpthread -lrt -o alloc_test
+//   ./alloc_test
+
+#include "constants.hpp"
+#include "sysfs.hpp"
+#include "pwm.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <system_error>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static std::atomic<unsigned long> _allocations{0};
+
+void* operator new(std::size_t size) {
+    _allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+static const int _ITERATIONS = 1000;
+static int _failures = 0;
+
+static void _check(bool ok, const char* what) {
+    std::printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+    if (!ok) {
+        _failures++;
+    }
+}
+
+template <typename F>
+static unsigned long _count(F hot_path) {
+    hot_path();  // warm up: first use may size buffers or insert map entries
+    unsigned long before = _allocations.load();
+    for (int i = 0; i < _ITERATIONS; i++) {
+        hot_path();
+    }
+    return _allocations.load() - before;
+}
+
+static void _value_paths() {
+    // A regular file stands in for a value attribute: same pread/pwrite at offset 0
+    char path[] = "/tmp/alloc_test_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "mkstemp");
+    }
+    unlink(path);
+
+    int64_t sum = 0;
+    unsigned long allocations = _count([&]() {
+        sysfs_write_int(fd, 1);
+        sum += sysfs_read_int(fd);
+        sysfs_write_int(fd, 0);
+        sum += sysfs_read_int(fd);
+    });
+    _check(allocations == 0, "sysfs_write_int/sysfs_read_int do not allocate");
+    _check(sum == _ITERATIONS + 1, "values read back");
+
+    // A failed read is an error, not a 0 that passes for a real value
+    ftruncate(fd, 0);
+    bool threw = false;
+    try {
+        sysfs_read_int(fd);
+    } catch (const std::system_error&) {
+        threw = true;
+    }
+    _check(threw, "sysfs_read_int throws on an empty attribute");
+    close(fd);
+}
+
+static std::string _fake_root() {
+    // The attributes the paths below touch, as the kernel would present them
+    char root[] = "/tmp/alloc_test_root_XXXXXX";
+    if (!mkdtemp(root)) {
+        throw std::system_error(errno, std::generic_category(), "mkdtemp");
+    }
+    std::string base = root;
+    const char* dirs[] = {"/sys", "/sys/class", "/sys/class/gpio", "/sys/class/gpio/gpio5",
+                          "/sys/class/pwm", "/sys/class/pwm/pwmchip0", "/sys/class/pwm/pwmchip0/pwm0",
+                          "/sys/class/pwm/pwmchip0/pwm1"};
+    for (const char* dir : dirs) {
+        mkdir((base + dir).c_str(), 0755);
+    }
+    const char* files[][2] = {
+        {"/sys/class/gpio/export", ""}, {"/sys/class/gpio/unexport", ""},
+        {"/sys/class/gpio/gpio5/value", "0\n"}, {"/sys/class/gpio/gpio5/direction", "out\n"},
+        {"/sys/class/pwm/pwmchip0/export", ""}, {"/sys/class/pwm/pwmchip0/unexport", ""},
+    };
+    for (const auto& file : files) {
+        FILE* f = std::fopen((base + file[0]).c_str(), "w");
+        std::fputs(file[1], f);
+        std::fclose(f);
+    }
+    const char* channels[] = {"/sys/class/pwm/pwmchip0/pwm0/", "/sys/class/pwm/pwmchip0/pwm1/"};
+    for (const char* channel : channels) {
+        // Writes do not truncate, as on sysfs; the loops keep every duty at 6 digits
+        const char* attrs[][2] = {{"period", "1000000\n"}, {"duty_cycle", "100000\n"}, {"enable", "0\n"}, {"polarity", "normal\n"}};
+        for (const auto& attr : attrs) {
+            FILE* f = std::fopen((base + channel + attr[0]).c_str(), "w");
+            std::fputs(attr[1], f);
+            std::fclose(f);
+        }
+    }
+    return base;
+}
+
+static void _kernel_paths() {
+    std::string root = _fake_root();
+    set_sysfs_root(root);
+
+    int level = 0;
+    int mismatches = 0;
+    unsigned long allocations = _count([&]() {
+        level = !level;
+        output(5, level);
+        if (input(5) != level) {
+            mismatches++;
+        }
+    });
+    _check(allocations == 0, "input()/output() on the value file do not allocate");
+    _check(mismatches == 0, "levels read back");
+
+    PWM_A pan(0, 0, 1000, 10);
+    PWM_A tilt(0, 1, 1000, 10);
+    PWMGroup group;
+    std::size_t pan_index = group.add(pan);
+    std::size_t tilt_index = group.add(tilt);
+
+    int step = 10;
+    allocations = _count([&]() {
+        step = (step < 99) ? step + 1 : 10;  // 100000..990000 ns
+        group.set_duty_cycle(pan_index, step);
+        group.set_duty_cycle(tilt_index, 109 - step);
+        group.commit();
+    });
+    _check(allocations == 0, "PWMGroup::commit does not allocate");
+
+    allocations = _count([&]() {
+        step = (step < 99) ? step + 1 : 10;
+        pan.duty_cycle(step);
+        PWM_Duty_Cycle_ns(0, 1, step * 10000);
+    });
+    _check(allocations == 0, "PWM_A::duty_cycle and PWM_Duty_Cycle_ns do not allocate");
+    _check(PWM_Get_Duty_Cycle_ns(0, 1) == step * 10000, "duty cycle read back");
+
+    // Written behind the group's back: commit() trusts its cache, resync() re-reads
+    group.set_duty_cycle(tilt_index, 50);
+    group.commit();
+    PWM_Duty_Cycle_ns(0, 1, 100000);
+    group.resync();
+    group.set_duty_cycle(tilt_index, 50);
+    group.commit();
+    _check(PWM_Get_Duty_Cycle_ns(0, 1) == 500000, "resync() picks up writes made outside the group");
+
+    set_sysfs_root("");
+    std::string cleanup = "rm -r " + root;
+    if (std::system(cleanup.c_str()) != 0) {
+        std::printf("could not remove %s\n", root.c_str());
+    }
+}
+
+int main() {
+    init_gpio();
+    _value_paths();
+    _kernel_paths();
+    return _failures ? 1 : 0;
+}